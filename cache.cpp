@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "cache.h"
+
+using namespace std;
+
+/// The result cache keeps the outcome of the spots run by go, so that a spot
+/// asked again, also with the suits renamed, is answered without running it.
+/// Entries are keyed by the canonical signature of the spot, see
+/// Spot::signature(), and by what else sets the outcome: the games and the
+/// precision in Monte Carlo, nothing else with full enumeration.
+///
+/// Monte Carlo entries are kept in LRU order, up to the cache's capacity, while
+/// exact ones never change and are cheap, so they are kept all and never
+/// evicted. Runs with a time limit, hand statistics or as a shard are not
+/// cached. The cache is off until given a capacity, and can be saved to a file
+/// and loaded back in later sessions. It is used by the command loop only, so
+/// it is not thread safe.
+
+namespace {
+
+constexpr char Magic[8] = { 'P', 'K', 'B', 'I', 'T', 'S', 'R', 'C' };
+constexpr uint32_t Version = 1;
+
+struct Key {
+    uint64_t sig[SIGNATURE_NB];
+    uint64_t games, precision, enumerate;
+
+    bool operator<(const Key& k) const {
+        return memcmp(this, &k, sizeof(Key)) < 0;
+    }
+};
+
+struct Entry {
+    Key key;
+    Result results[MAX_RESULTS];
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t signatureNb; // Entries of another layout can't be read
+    uint64_t entries;
+};
+
+struct Stats {
+    uint64_t lookups, hits, exactHits, stores, evictions;
+};
+
+typedef std::list<Entry>::iterator EntryIt;
+
+struct Cache {
+    std::list<Entry> lru; // Monte Carlo entries, the most recent first
+    std::map<Key, EntryIt> index;
+    std::map<Key, Entry> exact;
+    size_t capacity;
+    Stats stats;
+} RC;
+
+// Return false if the run can't be cached, otherwise set its key
+bool make_key(const Spot& s, const Args& a, Key& k)
+{
+    if (!RC.capacity || a.handStats || a.msLimit > 0 || a.shardsNum > 1)
+        return false;
+
+    memset(&k, 0, sizeof(k)); // Keys are compared raw
+    s.signature(k.sig);
+    k.enumerate = a.enumerate;
+
+    if (!a.enumerate) {
+        k.games = a.gamesNum;
+        memcpy(&k.precision, &a.precision, sizeof(a.precision));
+    }
+    return true;
+}
+
+void insert(const Entry& e)
+{
+    if (e.key.enumerate) {
+        RC.exact[e.key] = e;
+        return;
+    }
+
+    auto it = RC.index.find(e.key);
+    if (it != RC.index.end()) {
+        RC.lru.erase(it->second);
+        RC.index.erase(it);
+    }
+
+    RC.lru.push_front(e);
+    RC.index[e.key] = RC.lru.begin();
+
+    while (RC.lru.size() > RC.capacity) {
+        RC.index.erase(RC.lru.back().key);
+        RC.lru.pop_back();
+        RC.stats.evictions++;
+    }
+}
+
+} // namespace
+
+/// Look up the spot, run as in args, in the cache and, if found, set the
+/// results.
+bool cache_probe(const Spot& s, const Args& a, Result results[])
+{
+    Key k;
+    if (!make_key(s, a, k))
+        return false;
+
+    RC.stats.lookups++;
+
+    const Entry* e = nullptr;
+
+    if (k.enumerate) {
+        auto it = RC.exact.find(k);
+        e = it != RC.exact.end() ? &it->second : nullptr;
+        RC.stats.exactHits += !!e;
+    } else {
+        auto it = RC.index.find(k);
+        if (it != RC.index.end()) {
+            RC.lru.splice(RC.lru.begin(), RC.lru, it->second); // Now the most recent
+            e = &*it->second;
+        }
+    }
+
+    if (!e)
+        return false;
+
+    RC.stats.hits++;
+    std::copy(e->results, e->results + MAX_RESULTS, results);
+    return true;
+}
+
+/// Store the results of the spot, run as in args
+void cache_store(const Spot& s, const Args& a, const Result results[])
+{
+    Entry e;
+    if (!make_key(s, a, e.key))
+        return;
+
+    std::copy(results, results + MAX_RESULTS, e.results);
+    insert(e);
+    RC.stats.stores++;
+}
+
+/// Set the capacity of Monte Carlo entries, evicting the oldest ones past it.
+/// With 0 the cache is off, but keeps its entries.
+void cache_resize(size_t entries)
+{
+    RC.capacity = entries;
+
+    while (entries && RC.lru.size() > entries) {
+        RC.index.erase(RC.lru.back().key);
+        RC.lru.pop_back();
+        RC.stats.evictions++;
+    }
+}
+
+/// Remove all the entries, also the exact ones, and clear the statistics
+void cache_clear()
+{
+    RC.lru.clear();
+    RC.index.clear();
+    RC.exact.clear();
+    RC.stats = Stats();
+}
+
+/// Write all the entries to file, the exact ones first, then the other ones from
+/// the oldest, so that loading them back restores the LRU order.
+bool cache_save(const string& file)
+{
+    Header header = {};
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.signatureNb = SIGNATURE_NB;
+    header.entries = RC.exact.size() + RC.lru.size();
+
+    ofstream out(file, ios::binary | ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+
+    for (const auto& it : RC.exact)
+        out.write((const char*)&it.second, sizeof(Entry));
+
+    for (auto it = RC.lru.rbegin(); it != RC.lru.rend(); ++it)
+        out.write((const char*)&*it, sizeof(Entry));
+
+    if (!out) {
+        cerr << "Error writing cache: " << file << endl;
+        return false;
+    }
+
+    cout << "Saved " << header.entries << " cache entries to " << file << endl;
+    return true;
+}
+
+/// Add the entries of file to the cache, up to its capacity for the Monte Carlo
+/// ones. The cache should be on.
+bool cache_load(const string& file)
+{
+    ifstream in(file, ios::binary);
+    Header header = {};
+
+    if (!in) {
+        cerr << "Error opening cache: " << file << endl;
+        return false;
+    }
+
+    in.seekg(0, ios::end);
+    uint64_t size = uint64_t(in.tellg());
+    in.seekg(0);
+    in.read((char*)&header, sizeof(header));
+
+    if (   !in
+        || memcmp(header.magic, Magic, sizeof(Magic))
+        || header.version != Version
+        || header.signatureNb != SIGNATURE_NB
+        || size != sizeof(Header) + header.entries * sizeof(Entry)) {
+        cerr << "Invalid cache: " << file << endl;
+        return false;
+    }
+
+    if (!RC.capacity) {
+        cerr << "Cache is off, turn it on first" << endl;
+        return false;
+    }
+
+    Entry e;
+    for (uint64_t i = 0; i < header.entries && in.read((char*)&e, sizeof(e)); ++i)
+        insert(e);
+
+    cout << "Loaded " << header.entries << " cache entries from " << file << endl;
+    return true;
+}
+
+/// Print the size of the cache and the hits since it was cleared
+void pretty_cache()
+{
+    const Stats& s = RC.stats;
+
+    cout << "Cache " << (RC.capacity ? "on" : "off")
+         << ", entries: " << RC.lru.size() << "/" << RC.capacity
+         << " Monte Carlo, " << RC.exact.size() << " exact"
+         << "\nLookups: " << s.lookups << ", hits: " << s.hits
+         << " (" << std::fixed << std::setprecision(2)
+         << s.hits * 100.0 / std::max(s.lookups, uint64_t(1)) << "%), exact hits: "
+         << s.exactHits << ", stores: " << s.stores << ", evictions: " << s.evictions << endl;
+}
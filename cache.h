@@ -0,0 +1,16 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include <string>
+
+#include "poker.h"
+
+extern bool cache_probe(const Spot& s, const Args& a, Result results[]);
+extern void cache_store(const Spot& s, const Args& a, const Result results[]);
+extern void cache_resize(size_t entries);
+extern void cache_clear();
+extern bool cache_save(const std::string& file);
+extern bool cache_load(const std::string& file);
+extern void pretty_cache();
+
+#endif // #ifndef CACHE_H_INCLUDED
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <sstream>
+
+#include "poker.h"
+#include "poker_api.h"
+
+using namespace std;
+
+/// The C API of poker_api.h, a thin layer over Spot and run(), built into
+/// libpoker with 'make lib'. A poker_spot is a Spot with the options it was
+/// created with, both never modified after creation.
+
+struct poker_spot {
+    Spot spot;
+    Args args;
+};
+
+static_assert(POKER_TIE_UNIT == KTie, "Tie unit of the API and of the engine differ");
+
+poker_spot* poker_spot_create(const char* spot)
+{
+    if (!spot)
+        return nullptr;
+
+    poker_spot* s = new poker_spot();
+    istringstream is(spot);
+
+    if (!parse_args(is, s->args)) {
+        delete s;
+        return nullptr;
+    }
+    s->spot = Spot(s->args.players, s->args.pos, s->args.streets);
+
+    if (!s->spot.valid() || (s->args.enumerate && !s->spot.can_enumerate())) {
+        delete s;
+        return nullptr;
+    }
+
+    s->spot.set_deck_dealer(s->args.deck);
+    s->spot.set_evaluator(s->args.lut ? EV_LUT : EV_BITBOARD);
+    return s;
+}
+
+void poker_spot_destroy(poker_spot* s)
+{
+    delete s;
+}
+
+int poker_spot_players(const poker_spot* s)
+{
+    return int(s->spot.players());
+}
+
+int poker_spot_streets(const poker_spot* s)
+{
+    return int(s->spot.streets());
+}
+
+int64_t poker_run(const poker_spot* s, uint64_t games, unsigned threads, int enumerate,
+                  poker_result results[], size_t size)
+{
+    const Args& a = s->args;
+    size_t n = s->spot.players() * s->spot.streets();
+    bool e = enumerate || a.enumerate;
+    Result r[MAX_RESULTS] = {};
+
+    if (size < n)
+        return POKER_ERR_BUFFER;
+
+    if (e && !s->spot.can_enumerate())
+        return POKER_ERR_ENUMERATE;
+
+    // Explicit games are played all, otherwise also precision and time apply
+    size_t played = games ? run(s->spot, games, threads ? threads : a.threadsNum, e, r)
+                          : run(s->spot, a.gamesNum, threads ? threads : a.threadsNum, e, r,
+                                a.precision, a.msLimit);
+
+    for (size_t i = 0; i < n; ++i)
+        results[i] = { r[i].first, r[i].second };
+
+    return int64_t(played);
+}
+
+void poker_equities(const poker_result results[], int players, double equities[])
+{
+    uint64_t games = 0;
+    for (int p = 0; p < players; ++p)
+        games += KTie * results[p].won + results[p].tied;
+
+    for (int p = 0; p < players; ++p)
+        equities[p] = double(KTie * results[p].won + results[p].tied) / std::max(games, uint64_t(1));
+}
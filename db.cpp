@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "db.h"
+
+using namespace std;
+
+/// The preflop database is a binary file with precomputed results of the spots
+/// with no common cards and no ranges, that go consults before running them:
+///
+/// - For each of the 169 classes of hole cards (AA, AKs, AKo, ...) vs 1 to 8
+///   random opponents, the results of all the players.
+///
+/// - For each heads-up matchup of given hole cards, the results of the 2 players.
+///   Matchups that are the same up to a suit permutation and/or exchanging the
+///   players share the entry, so the 1326 x 1326 ones fit in few thousands, that
+///   are sorted by key and looked up with a binary search.
+///
+/// The file is memory mapped read-only, so that loading is instant and pages
+/// are shared among all the processes that load the same file.
+
+namespace {
+
+constexpr char Magic[8] = { 'P', 'K', 'B', 'I', 'T', 'S', 'D', 'B' };
+constexpr uint32_t Version = 3;
+constexpr int Classes = 169;
+constexpr int RandomResults = 44; // For 2, 3, ... 9 players: 2 + 3 + ... + 9
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t huEntries;
+    uint64_t randomGames; // Games of each spot vs random opponents
+    uint64_t huGames;     // Games of each heads-up spot, 0 if fully enumerated
+};
+
+// Tables follow the header in this order
+struct Tables {
+    const Header* header;
+    const Result* random;   // [Classes][RandomResults]
+    const Result* hu;       // [huEntries][2]
+    const uint32_t* huKeys; // [huEntries]
+    void* data;
+    size_t size;
+} DB;
+
+// Index of the class of 2 hole cards in a 13 x 13 grid: pairs on the diagonal,
+// suited above and offsuited below.
+int class_index(uint64_t holes)
+{
+    unsigned c1 = pop_msb(&holes), c2 = msb(holes);
+    unsigned v1 = std::max(c1 & 0xF, c2 & 0xF), v2 = std::min(c1 & 0xF, c2 & 0xF);
+
+    return (c1 >> 4) == (c2 >> 4) ? v1 * 13 + v2 : v2 * 13 + v1;
+}
+
+// The first result vs random opponents for a spot of 'players' players
+int random_offset(size_t players)
+{
+    return int(players * (players - 1) / 2 - 1);
+}
+
+// Pack 2 hole cards as 12 bits, the highest card first
+uint32_t hole_key(uint64_t holes)
+{
+    return (msb(holes) << 6) | lsb(holes);
+}
+
+uint64_t key_holes(uint32_t key)
+{
+    return (1ULL << ((key >> 6) & 0x3F)) | (1ULL << (key & 0x3F));
+}
+
+// Key of a heads-up matchup: the smallest one among all the suit permutations,
+// with players in both the orders. Set swapped if it is reached exchanging them.
+uint32_t hu_key(uint64_t h1, uint64_t h2, bool& swapped)
+{
+    uint32_t best = ~0U;
+    swapped = false;
+
+    for (const uint8_t* p : SuitPerms) {
+        uint32_t k1 = hole_key(permute_suits(h1, p));
+        uint32_t k2 = hole_key(permute_suits(h2, p));
+
+        if (((k1 << 12) | k2) < best)
+            best = (k1 << 12) | k2, swapped = false;
+
+        if (((k2 << 12) | k1) < best)
+            best = (k2 << 12) | k1, swapped = true;
+    }
+
+    return best;
+}
+
+// Make a Spot out of the given hole cards, the missing ones are random
+Spot make_spot(size_t players, const vector<uint64_t>& holes)
+{
+    uint64_t given[PLAYERS_NB] = {};
+    RangePtr ranges[PLAYERS_NB];
+
+    std::copy(holes.begin(), holes.end(), given);
+    return Spot(int(players), given, ranges, 0);
+}
+
+void* map_file(const string& file, size_t& size)
+{
+#ifdef _WIN32
+    HANDLE fd = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fd == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER sz;
+    GetFileSizeEx(fd, &sz);
+    size = size_t(sz.QuadPart);
+
+    HANDLE mmap = CreateFileMapping(fd, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(fd);
+    if (!mmap)
+        return nullptr;
+
+    void* data = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mmap); // The view keeps the mapping alive
+    return data;
+#else
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+
+    struct stat st;
+    fstat(fd, &st);
+    size = size_t(st.st_size);
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? nullptr : data;
+#endif
+}
+
+void unmap_file(void* data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+} // namespace
+
+/// Compute all the database's spots and write them to file. Spots vs random
+/// opponents are always run with a Monte Carlo of gamesNum games, heads-up ones
+/// are fully enumerated if so requested.
+bool db_build(const string& file, size_t gamesNum, size_t threadsNum, bool enumerate)
+{
+    Header header = {};
+    vector<Result> random(Classes * RandomResults), hu;
+    vector<uint32_t> keys;
+
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.randomGames = gamesNum;
+    header.huGames = enumerate ? 0 : gamesNum;
+
+    // Each class is run with suits chosen in the lowest rows
+    vector<Spot> spots;
+    for (unsigned v1 = 0; v1 < 13; ++v1)
+        for (unsigned v2 = 0; v2 < 13; ++v2) {
+            uint64_t holes = (1ULL << v1) | (1ULL << (v2 + 16 * (v1 <= v2)));
+
+            for (size_t p = 2; p <= PLAYERS_NB; ++p)
+                spots.push_back(make_spot(p, { holes }));
+        }
+
+    vector<Result> results(spots.size() * MAX_RESULTS);
+    run_many(spots, gamesNum, threadsNum, false, results.data());
+
+    for (size_t i = 0; i < spots.size(); ++i) {
+        size_t p = spots[i].players();
+        const Result* r = &results[i * MAX_RESULTS];
+        std::copy(r, r + p, &random[class_index(spots[i].hole_cards(0)) * RandomResults
+                                    + random_offset(p)]);
+    }
+
+    cout << "Computed " << Classes << " classes vs random opponents" << endl;
+
+    // Collect the keys of all the heads-up matchups
+    vector<uint64_t> holes;
+    for (unsigned c1 = 0; c1 < 64; ++c1)
+        for (unsigned c2 = 0; c2 < c1; ++c2)
+            if ((c1 & 0xF) < 13 && (c2 & 0xF) < 13)
+                holes.push_back((1ULL << c1) | (1ULL << c2));
+
+    for (size_t i = 0; i < holes.size(); ++i)
+        for (size_t j = i + 1; j < holes.size(); ++j)
+            if (!(holes[i] & holes[j])) {
+                bool swapped;
+                keys.push_back(hu_key(holes[i], holes[j], swapped));
+            }
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    spots.clear();
+    for (uint32_t k : keys)
+        spots.push_back(make_spot(2, { key_holes(k >> 12), key_holes(k) }));
+
+    results.assign(spots.size() * MAX_RESULTS, Result());
+    run_many(spots, gamesNum, threadsNum, enumerate, results.data());
+
+    for (size_t i = 0; i < spots.size(); ++i) {
+        hu.push_back(results[i * MAX_RESULTS]);
+        hu.push_back(results[i * MAX_RESULTS + 1]);
+    }
+
+    cout << "Computed " << keys.size() << " heads-up matchups" << endl;
+
+    header.huEntries = uint32_t(keys.size());
+
+    ofstream out(file, ios::binary | ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)random.data(), random.size() * sizeof(Result));
+    out.write((const char*)hu.data(), hu.size() * sizeof(Result));
+    out.write((const char*)keys.data(), keys.size() * sizeof(uint32_t));
+
+    if (!out) {
+        cerr << "Error writing database: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+/// Map the database file in memory, replacing the current one if any
+bool db_load(const string& file)
+{
+    size_t size = 0;
+    void* data = map_file(file, size);
+
+    if (!data) {
+        cerr << "Error opening database: " << file << endl;
+        return false;
+    }
+
+    const Header* header = (const Header*)data;
+    size_t huEntries = size >= sizeof(Header) ? header->huEntries : 0;
+
+    if (   size < sizeof(Header)
+        || memcmp(header->magic, Magic, sizeof(Magic))
+        || header->version != Version
+        || size !=  sizeof(Header) + Classes * RandomResults * sizeof(Result)
+                  + huEntries * (2 * sizeof(Result) + sizeof(uint32_t))) {
+        cerr << "Invalid database: " << file << endl;
+        unmap_file(data, size);
+        return false;
+    }
+
+    if (DB.data)
+        unmap_file(DB.data, DB.size);
+
+    DB.header = header;
+    DB.random = (const Result*)(header + 1);
+    DB.hu = DB.random + Classes * RandomResults;
+    DB.huKeys = (const uint32_t*)(DB.hu + 2 * huEntries);
+    DB.data = data;
+    DB.size = size;
+
+    cout << "Loaded database " << file << " with " << huEntries
+         << " heads-up matchups" << endl;
+    return true;
+}
+
+/// Look up the spot in the database and, if found, set the results. Only
+/// preflop spots with given hole cards for both players in heads-up, or for
+/// the first player vs random ones are stored. In case of full enumeration
+/// only exact results are returned.
+bool db_probe(const Spot& s, bool enumerate, Result results[])
+{
+    if (!DB.header || !s.preflop())
+        return false;
+
+    uint64_t h1 = s.hole_cards(0), h2 = s.hole_cards(1);
+
+    if (popcount(h1) != 2)
+        return false;
+
+    if (s.players() == 2 && popcount(h2) == 2 && !(enumerate && DB.header->huGames)) {
+        bool swapped;
+        uint32_t k = hu_key(h1, h2, swapped);
+        const uint32_t* end = DB.huKeys + DB.header->huEntries;
+        const uint32_t* it = std::lower_bound(DB.huKeys, end, k);
+
+        if (it == end || *it != k)
+            return false;
+
+        const Result* r = DB.hu + 2 * (it - DB.huKeys);
+        results[0] = r[swapped];
+        results[1] = r[!swapped];
+        return true;
+    }
+
+    for (size_t p = 1; p < s.players(); ++p)
+        if (s.hole_cards(p))
+            return false;
+
+    if (enumerate)
+        return false;
+
+    const Result* r = DB.random + class_index(h1) * RandomResults;
+    std::copy(r + random_offset(s.players()), r + random_offset(s.players() + 1), results);
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef DB_H_INCLUDED
+#define DB_H_INCLUDED
+
+#include <string>
+
+#include "poker.h"
+
+extern bool db_build(const std::string& file, size_t gamesNum, size_t threadsNum, bool enumerate);
+extern bool db_load(const std::string& file);
+extern bool db_probe(const Spot& s, bool enumerate, Result results[]);
+
+#endif // #ifndef DB_H_INCLUDED
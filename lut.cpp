@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "poker.h"
+
+using namespace std;
+
+/// The lookup table evaluator gives the same scores of Hand::do_score(), read
+/// out of tables instead of computed, with no loop and a single branch:
+///
+/// - A hand with a flush scores as the ranks of the flush suit alone, at most
+///   13 bits, that index the flush table.
+///
+/// - Any other hand scores as the multiset of its ranks, that is the hand's
+///   score before do_score(), with one row for each copy of a rank. The 73775
+///   multisets of 5 to 7 cards are the keys of a perfect hash, so a lookup is
+///   a multiply, a displacement and the slot, with no probing.
+///
+/// Tables store 16 bit indices into the 7462 distinct scores, so that they all
+/// take about 400KB and stay in cache. They are built out of do_score() itself
+/// the first time they are used, in few milliseconds.
+///
+/// The perfect hash is a hash and displace one: the multiply spreads the keys
+/// into buckets of few keys each, then each bucket, the biggest ones first,
+/// looks for the first displacement that sends all its keys to free slots.
+
+namespace {
+
+constexpr int BucketBits = 15;
+constexpr int SlotBits = 17;
+constexpr uint64_t SlotMul = 0xD6E8FEB86659FD93ULL;
+
+// Multipliers tried in order until the perfect hash is found, the first one
+// does it, the other ones are just for safety.
+constexpr uint64_t KeyMuls[] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                 0x165667B19E3779F9ULL, 0xFF51AFD7ED558CCDULL };
+
+struct Tables {
+    std::vector<uint64_t> scores; // Distinct scores, indexed by the tables below
+    std::vector<uint16_t> flush;  // [8192] by the ranks of the flush suit
+    std::vector<uint16_t> disp;   // [1 << BucketBits] displacement of each bucket
+    std::vector<uint16_t> slots;  // [1 << SlotBits] by the hash of the ranks
+    uint64_t mul;
+
+    Tables();
+    bool build_hash(const std::vector<uint64_t>& keys, const std::vector<uint16_t>& idx,
+                    uint64_t m);
+    uint16_t index_of(uint64_t score);
+
+    uint64_t get(uint64_t score, uint64_t cards, uint32_t suits) const {
+
+        if (suits & IsFlush) {
+            unsigned r = lsb(suits & IsFlush) / 4;
+            return scores[flush[(cards >> (16 * r)) & 0x1FFF]];
+        }
+
+        uint64_t h = score * mul;
+        uint64_t d = disp[h >> (64 - BucketBits)];
+        return scores[slots[((h + d) * SlotMul) >> (64 - SlotBits)]];
+    }
+};
+
+uint16_t Tables::index_of(uint64_t score)
+{
+    auto it = std::lower_bound(scores.begin(), scores.end(), score);
+    return uint16_t(it - scores.begin());
+}
+
+// Add the multisets of ranks from rank r on, given the ones below, as raw
+// scores with one row for each copy of a rank.
+void add_multisets(std::vector<uint64_t>& keys, uint64_t score, unsigned r, unsigned cnt)
+{
+    if (r == 13) {
+        if (cnt >= 5)
+            keys.push_back(score);
+        return;
+    }
+
+    uint64_t rows = 0;
+    for (unsigned c = 0; c <= 4 && cnt + c <= 7; ++c) {
+        add_multisets(keys, score | rows, r + 1, cnt + c);
+        rows |= (1ULL << r) << (16 * c);
+    }
+}
+
+// Score as do_score() does a hand with no flush, out of the raw score only
+uint64_t plain_score(uint64_t raw)
+{
+    Hand h = { raw, 0, SuitInit };
+    h.do_score();
+    return h.score;
+}
+
+// Score of 5 to 7 cards of the same suit, with their ranks given in mask
+uint64_t flush_score(unsigned mask)
+{
+    Hand h = Hand();
+    h.suits = SuitInit;
+    for (uint64_t b = mask; b; )
+        h.add(Card(pop_lsb(&b)), 0);
+    h.do_score();
+    return h.score;
+}
+
+Tables::Tables() : flush(1 << 13), disp(1 << BucketBits), slots(1 << SlotBits)
+{
+    std::vector<uint64_t> keys;
+    add_multisets(keys, 0, 0, 0);
+
+    for (uint64_t k : keys)
+        scores.push_back(plain_score(k));
+
+    for (unsigned m = 0; m < (1 << 13); ++m)
+        if (popcount(m) >= 5 && popcount(m) <= 7)
+            scores.push_back(flush_score(m));
+
+    std::sort(scores.begin(), scores.end());
+    scores.erase(std::unique(scores.begin(), scores.end()), scores.end());
+
+    for (unsigned m = 0; m < (1 << 13); ++m)
+        if (popcount(m) >= 5 && popcount(m) <= 7)
+            flush[m] = index_of(flush_score(m));
+
+    std::vector<uint16_t> idx;
+    for (uint64_t k : keys)
+        idx.push_back(index_of(plain_score(k)));
+
+    for (uint64_t m : KeyMuls)
+        if (build_hash(keys, idx, m))
+            return;
+
+    cerr << "Cannot build the lookup tables" << endl;
+    exit(EXIT_FAILURE);
+}
+
+/// Place the keys in the slots with multiplier m and set their score indices,
+/// return false if some bucket has no displacement that fits.
+bool Tables::build_hash(const std::vector<uint64_t>& keys,
+                        const std::vector<uint16_t>& idx, uint64_t m)
+{
+    std::vector<std::vector<size_t>> buckets(1 << BucketBits);
+    std::vector<bool> used(1 << SlotBits);
+    std::vector<size_t> order, taken;
+
+    mul = m;
+
+    for (size_t i = 0; i < keys.size(); ++i)
+        buckets[(keys[i] * mul) >> (64 - BucketBits)].push_back(i);
+
+    for (size_t b = 0; b < buckets.size(); ++b)
+        order.push_back(b);
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    for (size_t b : order) {
+        if (buckets[b].empty())
+            break;
+
+        uint64_t d = 0;
+        for ( ; d <= 0xFFFF; ++d) {
+            taken.clear();
+            for (size_t i : buckets[b]) {
+                size_t s = ((keys[i] * mul + d) * SlotMul) >> (64 - SlotBits);
+                if (used[s] || std::find(taken.begin(), taken.end(), s) != taken.end())
+                    break;
+                taken.push_back(s);
+            }
+            if (taken.size() == buckets[b].size())
+                break;
+        }
+
+        if (d > 0xFFFF)
+            return false;
+
+        disp[b] = uint16_t(d);
+        for (size_t k = 0; k < taken.size(); ++k) {
+            used[taken[k]] = true;
+            slots[taken[k]] = idx[buckets[b][k]];
+        }
+    }
+    return true;
+}
+
+// Built at first use, then shared read only by all the threads
+const Tables& tables()
+{
+    static const Tables T;
+    return T;
+}
+
+} // namespace
+
+/// Same as score_hands() with the bitboard evaluator, but out of the lookup
+/// tables. The hands should have 5 to 7 cards, as all the scored ones do.
+void score_lut(uint64_t score[], const uint64_t cards[], const uint32_t suits[], size_t n)
+{
+    const Tables& T = tables();
+
+    for (size_t i = 0; i < n; ++i)
+        score[i] = T.get(score[i], cards[i], suits[i]);
+}
+
+/// Score random hands of 5, 6 and 7 cards with both the evaluators and with
+/// Hand::do_score(), and print the ones where they disagree. Return the number
+/// of these hands.
+size_t lut_check(size_t hands)
+{
+    constexpr size_t MaxPrinted = 3;
+
+    PRNG prng(0);
+    std::vector<uint64_t> bits(hands), lut(hands), cards(hands);
+    std::vector<uint32_t> suits(hands);
+    std::vector<Hand> ref(hands);
+    size_t failed = 0;
+
+    for (size_t i = 0; i < hands; ++i) {
+        Hand h = Hand();
+        h.suits = SuitInit;
+
+        for (unsigned k = 5 + i % 3; k; ) {
+            Card c = Card(prng.next() & 0x3F);
+            k -= (c & 0xF) < 13 && h.add(c, 0);
+        }
+
+        bits[i] = lut[i] = h.score;
+        cards[i] = h.cards;
+        suits[i] = h.suits;
+        ref[i] = h;
+        ref[i].do_score();
+    }
+
+    score_hands(bits.data(), cards.data(), suits.data(), hands, TX_ANY, EV_BITBOARD);
+    score_hands(lut.data(), cards.data(), suits.data(), hands, TX_ANY, EV_LUT);
+
+    for (size_t i = 0; i < hands; ++i)
+        if (bits[i] != ref[i].score || lut[i] != ref[i].score) {
+            if (++failed <= MaxPrinted)
+                cout << "Mismatch on hand:" << ref[i]
+                     << "\nBitboard: " << bits[i] << ", lookup tables: " << lut[i]
+                     << ", do_score(): " << ref[i].score << endl;
+        }
+
+    cout << "Checked " << hands << " random hands of 5, 6 and 7 cards: "
+         << (failed ? std::to_string(failed) + " mismatches" : "all scores agree") << endl;
+
+    return failed;
+}
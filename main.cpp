@@ -1,11 +1,16 @@
+#include <algorithm>
 #include <chrono>
-#include <cstring>
 #include <iostream>
-#include <map>
 #include <sstream>
 #include <string>
+#include <thread>
 
+#include "cache.h"
+#include "db.h"
+#include "matrix.h"
+#include "microbench.h"
 #include "poker.h"
+#include "server.h"
 #include "util.h"
 
 using namespace std;
@@ -42,110 +47,128 @@ struct Hash {
     static const uint64_t Mulp = 2654435789;
     uint64_t mix = 104395301;
 
-    void operator<<(unsigned v) { mix += (v * Mulp) ^ (mix >> 23); }
+    void operator<<(uint64_t v) { mix += (v * Mulp) ^ (mix >> 23); }
     uint64_t get() { return mix ^ (mix << 37); }
 };
 
-// Stores parsed args out of the position string
-struct Args {
-    Result results[PLAYERS_NB];
-    string pos;
-    size_t gamesNum, threadsNum;
-    int players;
-    bool enumerate;
-};
-
-void parse_args(istringstream& is, Args& parsed)
+// Print the results in args, of each street in street mode
+void print_results(const Args& args, size_t streets)
 {
-    enum States { Option, Hole, Common };
-
-    map<string, string> args;
-    string token, value, sep = " ";
-    int holesCnt = 0;
-    States st = Option;
-
-    // Parse arguments
-    while (is >> token) {
-        if (st == Option) {
-            if (token == "-p" || token == "-t" || token == "-g") {
-                if (is >> value)
-                    args[token.substr(1, 1)] = value;
-                continue;
-            } else if (token == "-e") {
-                args["e"] = "true";
-                continue;
-            } else if (token == "-") {
-                st = Common;
-                continue;
-            } else
-                st = Hole;
-        }
-        if (st == Hole) {
-            if (token == "-") {
-                st = Common;
-                continue;
-            }
-            if (token.front() == '[')
-                sep = "";
-            if (token.back() == ']')
-                sep = " ";
-            args["holes"] += token + sep;
-            holesCnt++;
-        }
-        if (st == Common)
-            args["commons"] += token;
-    }
-
-    // Process options
-    parsed.enumerate  = (args["e"] == "true");
-    parsed.threadsNum = (args["t"].size() ? stoi(args["t"]) : 1);
-    parsed.players    = (args["p"].size() ? stoi(args["p"]) : holesCnt);
-
-    if (args["g"].size()) {
-        string g = args["g"];
-        parsed.gamesNum = 1;
-        if (tolower(g.back()) == 'm')
-            parsed.gamesNum = 1000 * 1000, g.pop_back();
-        else if (tolower(g.back()) == 'k')
-            parsed.gamesNum = 1000, g.pop_back();
-        parsed.gamesNum *= stoi(g);
-    } else
-        parsed.gamesNum = 1000 * 1000;
-
-    parsed.pos = args["holes"] + "- " + args["commons"];
+    if (streets == 1) {
+        pretty_results(args.results, args.players);
+        return;
+    }
+
+    const char* Streets[] = { "Flop", "Turn", "River" };
+
+    for (size_t i = 0; i < streets; ++i) {
+        cout << "\n" << Streets[i] << ":";
+        pretty_results(args.results + i * args.players, args.players);
+    }
 }
 
-void go(istringstream& is, Args& args)
+// go() runs a spot, also looked up in the result cache if cached is set
+void go(istringstream& is, Args& args, bool cached = true)
 {
-    parse_args(is, args);
+    if (!parse_args(is, args)) {
+        cerr << "Invalid option value" << endl;
+        return;
+    }
 
-    Spot s(args.players, args.pos);
+    Spot s(args.players, args.pos, args.streets);
     if (!s.valid()) {
         cerr << "Error in: " << args.pos << endl;
         return;
     }
-    memset(args.results, 0, sizeof(args.results));
-    run(s, args.gamesNum, args.threadsNum, args.enumerate, args.results);
-    pretty_results(args.results, args.players);
+    if (args.shard >= args.shardsNum) {
+        cerr << "Invalid shard, should be like -k 1/4" << endl;
+        return;
+    }
+    for (size_t p = 0; p < s.players(); ++p)
+        if (s.range_size(p))
+            cout << "Set range " << s.range(p)->token << " for player " << p + 1
+                 << " of size: " << s.range_size(p) << endl;
+
+    std::fill(args.results, args.results + MAX_RESULTS, Result());
+    s.set_deck_dealer(args.deck);
+    s.set_evaluator(args.lut ? EV_LUT : EV_BITBOARD);
+
+    std::unique_ptr<HandStats> stats(args.handStats ? new HandStats() : nullptr);
+
+    // A shard must play its part, the database has the results of the whole run
+    if (!stats && args.shardsNum == 1 && db_probe(s, args.enumerate, args.results))
+        cout << "Found in preflop database" << endl;
+
+    else if (cached && cache_probe(s, args, args.results))
+        cout << "Found in cache" << endl;
+
+    else {
+        size_t n = run(s, args.gamesNum, args.threadsNum, args.enumerate, args.results,
+                       args.precision, args.msLimit, stats.get(), args.shard, args.shardsNum);
+        if (args.enumerate && n)
+            cout << "Evaluated " << n << " combinations" << endl;
+        else if (args.precision > 0 || args.msLimit > 0)
+            cout << "Played " << n << " games" << endl;
+
+        // A run that failed, like an enumeration missing too many cards, has
+        // no results to cache.
+        if (cached && n)
+            cache_store(s, args, args.results);
+    }
+    if (stats)
+        pretty_stats(*stats, args.players);
+
+    print_results(args, s.streets());
+}
+
+// db() builds the preflop database with 'db build <file> [-g N] [-t N] [-e]', or
+// loads it with 'db load <file>'. Once loaded, go consults it first. Entries are
+// all of the same games, so -c and -ms, that stop a run early, don't apply.
+void db(istringstream& is)
+{
+    Args args;
+    string cmd, file;
+
+    if (!(is >> cmd >> file))
+        cout << "Missing database command or file" << endl;
+
+    else if (cmd == "build") {
+        if (!parse_args(is, args))
+            cout << "Invalid option value" << endl;
+        else if (args.precision > 0 || args.msLimit > 0)
+            cout << "Options -c and -ms are not supported by db build" << endl;
+        else if (db_build(file, args.gamesNum, args.threadsNum, args.enumerate))
+            db_load(file);
+    }
+    else if (cmd == "load")
+        db_load(file);
+
+    else
+        cout << "Unknown database command: " << cmd << endl;
 }
 
-// bench() runs a benchmark for speed and signature
+// bench() runs a benchmark for speed and signature with 'bench [threads] [options]',
+// where the options, like -l, are added to the ones of each position.
 void bench(istringstream& is)
 {
-    constexpr uint64_t GoodSig = 12568965866008609937ULL;
+    constexpr uint64_t GoodSig = 5607004243346921348ULL;
 
     Args args;
     string token;
     Hash sig;
     uint64_t cards = 0, spots = 0, cnt = 0;
     string threads = (is >> token) ? "-t " + token + " " : "-t 1 ";
+    string options;
+
+    if (getline(is, options))
+        threads += options + " ";
 
     TimePoint elapsed = now();
 
     for (const string& pos : BenchPos) {
         cerr << "\nPosition " << ++cnt << ": " << pos << endl;
         istringstream ss(threads + pos);
-        go(ss, args);
+        go(ss, args, false);
 
         for (int p = 0; p < args.players; ++p)
             sig << args.results[p].first + args.results[p].second;
@@ -163,20 +186,146 @@ void bench(istringstream& is)
          << "\nGames/second : " << 1000 * spots / elapsed
          << "\nSignature    : " << sig.get();
 
-    if (sig.get() == GoodSig)
-        cerr << " (OK)";
-    else if (threads == "-t 1 ")
-        cerr << " (FAIL)";
+    cerr << (sig.get() == GoodSig ? " (OK)" : " (FAIL)");
 
     cerr << endl;
 }
 
+// cache() sets up the result cache of go with 'cache on [entries]', default to
+// 4096 entries, or 'cache off', empties it with 'cache clear', saves and loads
+// it with 'cache save <file>' and 'cache load <file>'. With no command, or
+// after one, it prints the entries and the hits.
+void cache(istringstream& is)
+{
+    string cmd, token;
+    uint64_t entries = 4096;
+
+    is >> cmd;
+
+    if (cmd == "on" && is >> token && !parse_number(token, SIZE_MAX, entries)) {
+        cout << "Invalid number of entries: " << token << endl;
+        return;
+    }
+    else if (cmd == "on")
+        cache_resize(std::max(size_t(entries), size_t(1)));
+
+    else if (cmd == "off")
+        cache_resize(0);
+
+    else if (cmd == "clear")
+        cache_clear();
+
+    else if ((cmd == "save" || cmd == "load") && !(is >> token)) {
+        cout << "Missing cache file" << endl;
+        return;
+    }
+    else if (cmd == "save")
+        cache_save(token);
+
+    else if (cmd == "load")
+        cache_load(token);
+
+    else if (cmd.size()) {
+        cout << "Unknown cache command: " << cmd << endl;
+        return;
+    }
+    pretty_cache();
+}
+
+// check() cross-checks the evaluators on random hands with 'check [hands]',
+// default to 1M hands, up to 100M.
+void check(istringstream& is)
+{
+    string token;
+    uint64_t hands = 1000 * 1000;
+
+    if (is >> token && !parse_number(token, 100 * 1000 * 1000, hands)) {
+        cout << "Invalid number of hands: " << token << endl;
+        return;
+    }
+    lut_check(size_t(hands));
+}
+
+// numa() pins the pool's threads to the CPUs of their NUMA nodes with
+// 'numa on', unpins them with 'numa off', and prints the nodes and the games
+// played on each one since the previous call.
+void numa(istringstream& is)
+{
+    string token;
+
+    if (is >> token && (token == "on" || token == "off"))
+        set_pinning(token == "on");
+
+    else if (!token.empty()) {
+        cout << "Unknown numa option: " << token << endl;
+        return;
+    }
+    pretty_numa();
+}
+
+// coordinate() runs a spot split among servers with 'cluster <addr>[,<addr>...]
+// <spot>', where the spot is the same of go, and prints the merged results. A
+// single server plays the whole run, as shard 1/1.
+void coordinate(istringstream& is)
+{
+    Args args;
+    string addrs, token, spot;
+    vector<string> servers;
+
+    if (!(is >> addrs) || !getline(is, spot)) {
+        cout << "Missing servers or spot" << endl;
+        return;
+    }
+
+    istringstream ss(addrs), ps(spot);
+    while (getline(ss, token, ','))
+        servers.push_back(token);
+
+    if (!parse_args(ps, args)) {
+        cerr << "Invalid option value" << endl;
+        return;
+    }
+
+    Spot s(args.players, args.pos, args.streets);
+    if (!s.valid()) {
+        cerr << "Error in: " << args.pos << endl;
+        return;
+    }
+
+    std::fill(args.results, args.results + MAX_RESULTS, Result());
+
+    if (cluster(servers, spot, s.players(), s.streets(), args.results))
+        print_results(args, s.streets());
+}
+
+// serve() starts the server with 'server <[host:]port|socket path> [-t N]',
+// running up to N spots at once for each connection, default to the cores,
+// of up to N threads each.
+void serve(istringstream& is)
+{
+    string addr, token;
+    size_t maxSpots = std::max(std::thread::hardware_concurrency(), 1U);
+
+    if (!(is >> addr)) {
+        cout << "Missing server address" << endl;
+        return;
+    }
+    uint64_t n;
+    if (is >> token && token == "-t" && is >> token) {
+        if (!parse_number(token, 1 << 16, n) || !n) {
+            cout << "Invalid number of spots: " << token << endl;
+            return;
+        }
+        maxSpots = size_t(n);
+    }
+
+    server(addr, maxSpots);
+}
+
 } // namespace
 
 int main(int argc, char* argv[])
 {
-    init_score_mask();
-
     Args args;
     string token, cmd;
 
@@ -198,6 +347,24 @@ int main(int argc, char* argv[])
             go(is, args);
         else if (token == "bench")
             bench(is);
+        else if (token == "microbench")
+            microbench(is);
+        else if (token == "check")
+            check(is);
+        else if (token == "stats")
+            pretty_counters();
+        else if (token == "numa")
+            numa(is);
+        else if (token == "db")
+            db(is);
+        else if (token == "cache")
+            cache(is);
+        else if (token == "matrix")
+            matrix(is);
+        else if (token == "server")
+            serve(is);
+        else if (token == "cluster")
+            coordinate(is);
         else
             cout << "Unknown command: " << cmd << endl;
 
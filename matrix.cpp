@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "poker.h"
+
+using namespace std;
+
+/// Matrix mode gives the equity of each combo of the hero vs the range of the
+/// villain, heads-up, on a board. Instead of running a spot per combo, each
+/// runout of the board is dealt once and all the combos of both players are
+/// scored on it, then each hero combo is compared with all the villain ones
+/// at once:
+///
+/// - Villain scores are sorted, overall and for each card among the combos
+///   with that card, so that the villain combos a hero combo beats are the
+///   ones below its score, minus the ones that share one of its cards.
+///
+/// - A villain combo with both the hero's cards, the same combo, is removed
+///   twice, so it is added back. It scores the same, so it adds to the ties.
+///
+/// That is a couple of binary searches for each hero combo, instead of a loop
+/// on the villain ones. Runouts are fully enumerated with -e, otherwise -g of
+/// them are sampled, in chunks seeded by their index as in run(), so that the
+/// outcome doesn't depend on the threads.
+
+namespace {
+
+const string AllCombos = "[22+,A2+,K2+,Q2+,J2+,T2+,92+,82+,72+,62+,52+,42+,32]";
+constexpr size_t ChunkBoards = 256;
+
+// Matchups of a hero combo: won, tied, each one half a pot, and played
+struct Cell {
+    uint64_t won, tied, games;
+};
+
+struct Matrix {
+    vector<Hand> combos;         // Of both the players, sorted by cards
+    vector<size_t> heroes;       // Hero's combos, as indices in combos
+    vector<uint8_t> villain;     // If the combo is in villain's range
+    uint8_t deck[DECK_NB];       // Cards not on the board
+    unsigned deckSize, missing;  // Missing common cards, dealt from the deck
+    Hand board;
+    Evaluator evaluator;
+};
+
+// Buffers of a thread, reused across boards
+struct Workspace {
+    vector<uint64_t> score, cards, comboScore;
+    vector<uint32_t> suits;
+    vector<size_t> idx;
+    vector<uint64_t> all, byCard[64];
+};
+
+// Score all the combos on the board with the runout, then add the matchups
+// of each hero combo to its cell.
+void play_board(const Matrix& m, uint64_t runout, Workspace& ws, Cell cells[])
+{
+    Hand b = m.board;
+    size_t n = 0;
+    uint64_t touched = 0;
+
+    while (runout)
+        b.add(Card(pop_lsb(&runout)), 0);
+
+    for (size_t i = 0; i < m.combos.size(); ++i) {
+        if (m.combos[i].cards & b.cards)
+            continue;
+
+        Hand h = b;
+        h.merge(m.combos[i]);
+        ws.idx[n] = i;
+        ws.score[n] = h.score;
+        ws.cards[n] = h.cards;
+        ws.suits[n++] = h.suits;
+    }
+
+    score_hands(ws.score.data(), ws.cards.data(), ws.suits.data(), n, TX_ANY, m.evaluator);
+
+    ws.all.clear();
+    std::fill(ws.comboScore.begin(), ws.comboScore.end(), 0); // 0 for combos on the board
+
+    for (size_t k = 0; k < n; ++k) {
+        size_t i = ws.idx[k];
+        ws.comboScore[i] = ws.score[k];
+
+        if (m.villain[i]) {
+            ws.all.push_back(ws.score[k]);
+            for (uint64_t c = m.combos[i].cards; c; ) {
+                unsigned sq = pop_lsb(&c);
+                if (!(touched & (1ULL << sq)))
+                    ws.byCard[sq].clear();
+                touched |= 1ULL << sq;
+                ws.byCard[sq].push_back(ws.score[k]);
+            }
+        }
+    }
+
+    std::sort(ws.all.begin(), ws.all.end());
+    for (uint64_t t = touched; t; ) {
+        unsigned sq = pop_lsb(&t);
+        std::sort(ws.byCard[sq].begin(), ws.byCard[sq].end());
+    }
+
+    // Villain combos below and equal to s, and all of them, in v
+    auto count = [](const vector<uint64_t>& v, uint64_t s, uint64_t& below, uint64_t& equal) {
+        auto lo = std::lower_bound(v.begin(), v.end(), s);
+        below = uint64_t(lo - v.begin());
+        equal = uint64_t(std::upper_bound(lo, v.end(), s) - lo);
+        return uint64_t(v.size());
+    };
+
+    for (size_t h = 0; h < m.heroes.size(); ++h) {
+        size_t i = m.heroes[h];
+        uint64_t s = ws.comboScore[i];
+        uint64_t c = m.combos[i].cards;
+
+        if (!s)
+            continue;
+
+        uint64_t below, equal, b1 = 0, e1 = 0, b2 = 0, e2 = 0, n1 = 0, n2 = 0;
+        uint64_t total = count(ws.all, s, below, equal);
+        unsigned sq1 = pop_lsb(&c), sq2 = lsb(c);
+
+        if (touched & (1ULL << sq1))
+            n1 = count(ws.byCard[sq1], s, b1, e1);
+        if (touched & (1ULL << sq2))
+            n2 = count(ws.byCard[sq2], s, b2, e2);
+
+        cells[h].won += below - b1 - b2;
+        cells[h].tied += equal - e1 - e2 + m.villain[i];
+        cells[h].games += total - n1 - n2 + m.villain[i];
+    }
+}
+
+// Enumerate the runouts from deck[first] on, with k cards still to add to
+// cards, and play the ones of this thread, the runouts with cnt % threads == id.
+void enumerate(const Matrix& m, size_t first, unsigned k, uint64_t cards, size_t& cnt,
+               size_t id, size_t threadsNum, Workspace& ws, Cell cells[])
+{
+    if (!k) {
+        if (cnt++ % threadsNum == id)
+            play_board(m, cards, ws, cells);
+        return;
+    }
+
+    for (size_t i = first; i + k <= m.deckSize; ++i)
+        enumerate(m, i + 1, k - 1, cards | (1ULL << m.deck[i]), cnt, id, threadsNum, ws, cells);
+}
+
+// Play the boards of a thread, enumerated or out of the chunks it takes, and
+// return how many they are.
+size_t work(const Matrix& m, const Args& a, size_t id, std::atomic<size_t>& nextChunk,
+            vector<Cell>& cells)
+{
+    Workspace ws;
+    ws.score.resize(m.combos.size());
+    ws.cards.resize(m.combos.size());
+    ws.suits.resize(m.combos.size());
+    ws.idx.resize(m.combos.size());
+    ws.comboScore.resize(m.combos.size());
+
+    if (a.enumerate) {
+        size_t cnt = 0;
+        enumerate(m, 0, m.missing, 0, cnt, id, a.threadsNum, ws, cells.data());
+        return cnt > id ? (cnt - id - 1) / a.threadsNum + 1 : 0;
+    }
+
+    size_t chunks = a.gamesNum / ChunkBoards + (a.gamesNum % ChunkBoards != 0);
+    size_t played = 0;
+
+    for (size_t c; (c = nextChunk.fetch_add(1)) < chunks; ) {
+        PRNG prng(c);
+        uint8_t deck[DECK_NB];
+        std::copy(m.deck, m.deck + m.deckSize, deck);
+
+        size_t boards = std::min(ChunkBoards, a.gamesNum - c * ChunkBoards);
+        played += boards;
+
+        for (size_t g = boards; g; --g) {
+            uint64_t runout = 0;
+
+            // Partial shuffle of the deck, the first missing cards are the runout
+            for (unsigned i = 0; i < m.missing; ++i) {
+                unsigned j = i + unsigned(prng.next() % (m.deckSize - i));
+                std::swap(deck[i], deck[j]);
+                runout |= 1ULL << deck[i];
+            }
+            play_board(m, runout, ws, cells.data());
+        }
+    }
+    return played;
+}
+
+// The 2 cards of a combo, the highest first, like "AhKd"
+string combo_str(uint64_t cards)
+{
+    unsigned c1 = pop_msb(&cards), c2 = msb(cards);
+
+    if ((c2 & 0xF) > (c1 & 0xF))
+        std::swap(c1, c2);
+
+    return { "23456789TJQKA"[c1 & 0xF], "dhcs"[c1 >> 4],
+             "23456789TJQKA"[c2 & 0xF], "dhcs"[c2 >> 4] };
+}
+
+// Print the equity of each class of the hero's combos in a 13 x 13 grid, with
+// pairs on the diagonal, suited above and offsuited below, then of each combo.
+void pretty_matrix(const Matrix& m, const vector<Cell>& cells)
+{
+    const char* Ranks = "AKQJT98765432";
+    Cell grid[13][13] = {};
+
+    for (size_t h = 0; h < m.heroes.size(); ++h) {
+        uint64_t cards = m.combos[m.heroes[h]].cards;
+        unsigned c1 = pop_msb(&cards), c2 = msb(cards);
+        unsigned r1 = 12 - std::max(c1 & 0xF, c2 & 0xF), r2 = 12 - std::min(c1 & 0xF, c2 & 0xF);
+        Cell& g = (c1 >> 4) == (c2 >> 4) ? grid[r1][r2] : grid[r2][r1];
+
+        g.won += cells[h].won;
+        g.tied += cells[h].tied;
+        g.games += cells[h].games;
+    }
+
+    auto equity = [](const Cell& c) { return (c.won + c.tied / 2.0) * 100 / c.games; };
+
+    cout << "\n   ";
+    for (int c = 0; c < 13; ++c)
+        cout << std::setw(6) << Ranks[c];
+
+    cout << std::fixed << std::setprecision(1);
+
+    for (int r = 0; r < 13; ++r) {
+        cout << "\n" << Ranks[r] << "  ";
+        for (int c = 0; c < 13; ++c)
+            if (grid[r][c].games)
+                cout << std::setw(6) << equity(grid[r][c]);
+            else
+                cout << std::setw(6) << "-";
+    }
+    cout << "\n" << std::setprecision(2);
+
+    for (size_t h = 0, k = 0; h < m.heroes.size(); ++h)
+        if (cells[h].games)
+            cout << (k++ % 8 ? "  " : "\n") << combo_str(m.combos[m.heroes[h]].cards)
+                 << std::setw(7) << equity(cells[h]) << "%";
+
+    cout << endl;
+}
+
+} // namespace
+
+/// Run the matrix mode with 'matrix [-g N] [-t N] [-e] [-l] <hero> <villain>
+/// [- <board>]', where hero and villain are ranges, hole cards or * for all
+/// the combos, like 'matrix -e * [QQ+,AK] - Ac 7d 2h'. Runs have a fixed number
+/// of boards, so -c and -ms are not supported.
+void matrix(istream& is)
+{
+    Args args;
+    Matrix m;
+    string token, line;
+
+    while (is >> token)
+        line += (token == "*" ? AllCombos : token) + " ";
+
+    istringstream ss(line);
+    if (!parse_args(ss, args)) {
+        cerr << "Invalid option value" << endl;
+        return;
+    }
+
+    if (args.precision > 0 || args.msLimit > 0) {
+        cerr << "Options -c and -ms are not supported by matrix" << endl;
+        return;
+    }
+
+    Spot s(2, args.pos);
+
+    if (!s.valid() || args.players != 2) {
+        cerr << "Error in: " << args.pos << ", should be 2 ranges or hole cards and the board"
+             << endl;
+        return;
+    }
+
+    // Combos of both the players, each one scored once on each board
+    vector<uint64_t> heroes, villains;
+
+    for (size_t p = 0; p < 2; ++p) {
+        vector<uint64_t>& v = p ? villains : heroes;
+
+        if (s.range(p))
+            for (const Hand& c : s.range(p)->combos)
+                v.push_back(c.cards);
+
+        else if (popcount(s.hole_cards(p)) == 2)
+            v.push_back(s.hole_cards(p));
+
+        else {
+            cerr << "Player " << p + 1 << " should have a range or 2 hole cards" << endl;
+            return;
+        }
+    }
+
+    vector<uint64_t> all = heroes;
+    all.insert(all.end(), villains.begin(), villains.end());
+    std::sort(all.begin(), all.end());
+    all.erase(std::unique(all.begin(), all.end()), all.end());
+
+    uint64_t board = s.common_cards();
+
+    for (uint64_t cards : all) {
+        Hand h = Hand();
+        for (uint64_t c = cards; c; )
+            h.add(Card(pop_lsb(&c)), 0);
+
+        m.combos.push_back(h);
+        m.villain.push_back(std::binary_search(villains.begin(), villains.end(), cards));
+    }
+
+    for (uint64_t cards : heroes)
+        if (!(cards & board))
+            m.heroes.push_back(std::lower_bound(all.begin(), all.end(), cards) - all.begin());
+
+    m.board = Hand();
+    m.board.suits = SuitInit;
+    for (uint64_t c = board; c; )
+        m.board.add(Card(pop_lsb(&c)), 0);
+
+    m.deckSize = 0;
+    for (unsigned c = 0; c < 64; ++c)
+        if (!(board & (1ULL << c)) && (c & 0xF) < 13)
+            m.deck[m.deckSize++] = uint8_t(c);
+
+    m.missing = 5 - popcount(board);
+    m.evaluator = args.lut ? EV_LUT : EV_BITBOARD;
+    args.threadsNum = std::max(args.threadsNum, size_t(1));
+
+    size_t boards = args.enumerate ? 1 : args.gamesNum;
+    if (args.enumerate)
+        for (unsigned i = 0; i < m.missing; ++i)
+            boards = boards * (m.deckSize - i) / (i + 1);
+
+    // Each worker of the pool adds up its own cells, then they are summed in order
+    vector<vector<Cell>> cells(args.threadsNum, vector<Cell>(m.heroes.size()));
+    std::atomic<size_t> nextChunk(0);
+
+    run_tasks(args.threadsNum, [&](size_t id) {
+        return work(m, args, id, nextChunk, cells[id]);
+    });
+
+    for (size_t id = 1; id < args.threadsNum; ++id)
+        for (size_t h = 0; h < m.heroes.size(); ++h) {
+            cells[0][h].won += cells[id][h].won;
+            cells[0][h].tied += cells[id][h].tied;
+            cells[0][h].games += cells[id][h].games;
+        }
+
+    cout << "Hero combos: " << m.heroes.size() << ", villain combos: " << villains.size()
+         << ", " << (args.enumerate ? "enumerated " : "sampled ") << boards << " boards"
+         << endl;
+
+    pretty_matrix(m, cells[0]);
+}
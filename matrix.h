@@ -0,0 +1,8 @@
+#ifndef MATRIX_H_INCLUDED
+#define MATRIX_H_INCLUDED
+
+#include <istream>
+
+extern void matrix(std::istream& is);
+
+#endif // #ifndef MATRIX_H_INCLUDED
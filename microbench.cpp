@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAS_TSC
+#endif
+
+#include "microbench.h"
+#include "poker.h"
+
+using namespace std;
+
+/// Micro benchmarks time the components of a run one by one, so that when the
+/// end-to-end number of bench moves we can tell which part did. Each one runs
+/// once to warm up caches and branch predictors, then is timed reps times. We
+/// report the median and the min time per operation, the median in TSC cycles
+/// where available, and the spread of the repetitions, one line per component
+/// in a fixed format, so that outputs of two builds can be diffed.
+
+/// MicroBench is a friend of Spot, to time the dealers that are private
+struct MicroBench {
+
+    static uint64_t pick_ranges(const Spot& s, PRNG& prng, size_t n) {
+        Hand picked[PLAYERS_NB];
+        uint64_t sink = 0;
+        for (size_t i = 0; i < n; ++i)
+            sink += s.pick_ranges(prng, picked);
+        return sink;
+    }
+
+    static uint64_t deal(const Spot& s, PRNG& prng, size_t n) {
+        Spot::State st = { &prng, nullptr, nullptr, INVALID };
+        Hand hands[PLAYERS_NB];
+        uint64_t sink = 0;
+        for (size_t i = 0; i < n; ++i) {
+            s.deal(st, prng, hands);
+            sink += hands[0].cards;
+        }
+        return sink;
+    }
+
+    static uint64_t deal_deck(const Spot& s, PRNG& prng, size_t n) {
+        Spot::State st = { &prng, nullptr, nullptr, INVALID };
+        Hand hands[PLAYERS_NB];
+        uint8_t live[DECK_NB];
+        uint64_t sink = 0;
+        std::copy(s.deck, s.deck + s.deckSize, live);
+        for (size_t i = 0; i < n; ++i) {
+            s.deal_deck(st, live, hands);
+            sink += hands[0].cards;
+        }
+        return sink;
+    }
+};
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+volatile uint64_t Sink; // Keeps the compiler from dropping the timed work
+
+uint64_t cycles()
+{
+#ifdef HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Time fn(), that performs ops operations, and print one line of results
+template<typename F>
+void measure(const string& name, size_t ops, size_t reps, F fn)
+{
+    vector<double> ns, cy;
+
+    Sink = Sink + fn(); // Warm up
+
+    for (size_t r = 0; r < reps; ++r) {
+        Clock::time_point t = Clock::now();
+        uint64_t c = cycles();
+        Sink = Sink + fn();
+        c = cycles() - c;
+        double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - t).count();
+
+        ns.push_back(elapsed / ops);
+        cy.push_back(double(c) / ops);
+    }
+
+    std::sort(ns.begin(), ns.end());
+    std::sort(cy.begin(), cy.end());
+
+    double median = ns[reps / 2];
+
+    cout << std::left << std::setw(18) << name << std::right
+         << std::setw(10) << ops
+         << std::fixed << std::setprecision(2)
+         << std::setw(10) << median
+         << std::setw(10) << ns.front()
+         << std::setw(11) << cy[reps / 2]
+         << std::setw(9) << (ns.back() - ns.front()) * 100 / median << endl;
+}
+
+// Cards of a string like "AcKd" as a bitmask
+uint64_t cards_of(const string& s)
+{
+    const string Values = "23456789TJQKA", Suits = "dhcs";
+    uint64_t b = 0;
+
+    for (size_t i = 0; i + 1 < s.size(); i += 2)
+        b |= 1ULL << (16 * Suits.find(s[i + 1]) + Values.find(s[i]));
+    return b;
+}
+
+// A spot of players with the given hole cards or ranges, and common cards
+Spot make_spot(int players, const vector<string>& holes, const string& commons)
+{
+    uint64_t given[PLAYERS_NB] = {};
+    RangePtr ranges[PLAYERS_NB];
+
+    for (size_t i = 0; i < holes.size(); ++i)
+        if (holes[i].front() == '[')
+            ranges[i] = get_range(holes[i]);
+        else
+            given[i] = cards_of(holes[i]);
+
+    return Spot(players, given, ranges, cards_of(commons));
+}
+
+// Random 7 card hands, as the board and the hole cards apart, and merged
+vector<Hand> random_hands(size_t n, vector<Hand>& boards, vector<Hand>& holes,
+                          vector<Card>& cards)
+{
+    PRNG prng(0);
+    vector<Hand> hands;
+
+    while (hands.size() < n) {
+        Hand board = Hand(), hole = Hand(), all = Hand();
+        board.suits = all.suits = SuitInit;
+
+        for (int k = 0; k < 7; ) {
+            Card c = Card(prng.next() & 0x3F);
+            if ((c & 0xF) < 13 && all.add(c, 0)) {
+                (k < 5 ? board : hole).add(c, 0);
+                cards.push_back(c);
+                k++;
+            }
+        }
+        boards.push_back(board);
+        holes.push_back(hole);
+        hands.push_back(all);
+    }
+    return hands;
+}
+
+} // namespace
+
+/// Run the micro benchmarks with 'microbench [reps]', default to 9 repetitions
+void microbench(istream& is)
+{
+    constexpr size_t N = 1 << 14;
+
+    uint64_t reps = 9;
+    string token;
+    if (is >> token && !parse_number(token, 1000 * 1000, reps)) {
+        cout << "Invalid number of repetitions: " << token << endl;
+        return;
+    }
+    reps = std::max(reps, uint64_t(1));
+
+    vector<Hand> boards, holes;
+    vector<Card> cards;
+    vector<Hand> hands = random_hands(N, boards, holes, cards);
+    vector<uint64_t> score(N), handCards(N), buf(N);
+    vector<uint32_t> suits(N);
+    vector<uint64_t> enumBuf;
+
+    for (size_t i = 0; i < N; ++i) {
+        handCards[i] = hands[i].cards;
+        suits[i] = hands[i].suits;
+    }
+
+    Spot ranges = make_spot(3, { "AcKd", "[QQ+,AK]", "[88+,T6s+,52o+]" }, "Qc3d");
+    Spot nine = make_spot(9, { "AcKd" }, "");
+    Spot enumSpot = make_spot(2, { "AcKd", "7h7s" }, "2c3d4h");
+
+    cout << "# scoring: "
+#if defined(USE_AVX512)
+         << "avx512"
+#elif defined(USE_AVX2)
+         << "avx2"
+#else
+         << "scalar"
+#endif
+         << ", repetitions: " << reps << ", cycles: "
+#ifdef HAS_TSC
+         << "tsc"
+#else
+         << "n/a"
+#endif
+         << "\n# " << std::left << std::setw(16) << "component" << std::right
+         << std::setw(10) << "ops" << std::setw(10) << "ns/op" << std::setw(10) << "min"
+         << std::setw(11) << "cycles/op" << std::setw(9) << "spread%" << endl;
+
+    PRNG prng(1);
+
+    measure("prng_next", N * 64, reps, [&]() {
+        uint64_t s = 0;
+        for (size_t i = 0; i < N * 64; ++i)
+            s += prng.next();
+        return s;
+    });
+
+    measure("prng_fill", N * 64, reps, [&]() {
+        for (size_t i = 0; i < 64; ++i)
+            prng.fill(buf.data(), N);
+        return buf[N - 1];
+    });
+
+    measure("hand_add", N * 7, reps, [&]() {
+        uint64_t s = 0;
+        for (size_t i = 0; i < N; ++i) {
+            Hand h = Hand();
+            h.suits = SuitInit;
+            for (size_t k = 0; k < 7; ++k)
+                h.add(cards[i * 7 + k], 0);
+            s += h.score;
+        }
+        return s;
+    });
+
+    measure("hand_merge", N, reps, [&]() {
+        uint64_t s = 0;
+        for (size_t i = 0; i < N; ++i) {
+            Hand h = boards[i];
+            h.merge(holes[i]);
+            s += h.score;
+        }
+        return s;
+    });
+
+    measure("hand_do_score", N, reps, [&]() {
+        uint64_t s = 0;
+        for (size_t i = 0; i < N; ++i) {
+            Hand h = hands[i];
+            h.do_score();
+            s += h.score;
+        }
+        return s;
+    });
+
+    measure("score_hands", N, reps, [&]() {
+        for (size_t i = 0; i < N; ++i)
+            score[i] = hands[i].score;
+        score_hands(score.data(), handCards.data(), suits.data(), N);
+        return score[N - 1];
+    });
+
+    measure("score_lut", N, reps, [&]() {
+        for (size_t i = 0; i < N; ++i)
+            score[i] = hands[i].score;
+        score_hands(score.data(), handCards.data(), suits.data(), N, TX_ANY, EV_LUT);
+        return score[N - 1];
+    });
+
+    measure("range_pick", N, reps, [&]() { return MicroBench::pick_ranges(ranges, prng, N); });
+    measure("deal_9p", N, reps, [&]() { return MicroBench::deal(nine, prng, N); });
+    measure("deal_deck_9p", N, reps, [&]() { return MicroBench::deal_deck(nine, prng, N); });
+
+    Spot::State st = { &prng, nullptr, nullptr, INVALID };
+    Result results[MAX_RESULTS] = {};
+    size_t combos = enumSpot.run_enumerate(st, enumBuf, 0, 1, results);
+
+    measure("enumerate", combos, reps, [&]() {
+        return uint64_t(enumSpot.run_enumerate(st, enumBuf, 0, 1, results));
+    });
+
+    measure("run_batch_9p", N, reps, [&]() {
+        nine.run_batch(st, N, results);
+        return results[0].first;
+    });
+}
@@ -0,0 +1,8 @@
+#ifndef MICROBENCH_H_INCLUDED
+#define MICROBENCH_H_INCLUDED
+
+#include <istream>
+
+extern void microbench(std::istream& is);
+
+#endif // #ifndef MICROBENCH_H_INCLUDED
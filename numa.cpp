@@ -0,0 +1,123 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "numa.h"
+
+using namespace std;
+
+/// The NUMA topology is read once, as the CPUs of each node among the ones the
+/// process may run on. Pool's thread 'id' goes to node id % nodes, so that
+/// threads are spread over all the nodes whatever their number, and then to
+/// the next CPU of that node. Where the topology is not available, as off
+/// Linux, there is a single node with no CPUs listed and threads aren't pinned.
+
+namespace {
+
+#ifdef __linux__
+
+cpu_set_t ProcessMask; // CPUs allowed at startup, restored by numa_unpin()
+
+// Parse a cpulist like "0-15,32-47"
+vector<int> parse_cpulist(const string& list)
+{
+    vector<int> cpus;
+    istringstream is(list);
+    string range;
+
+    while (getline(is, range, ',')) {
+        size_t dash = range.find('-');
+        int first = stoi(range), last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+
+        for (int c = first; c <= last; ++c)
+            if (c < CPU_SETSIZE && CPU_ISSET(c, &ProcessMask))
+                cpus.push_back(c);
+    }
+    return cpus;
+}
+
+vector<vector<int>> read_topology()
+{
+    vector<vector<int>> nodes;
+    string list;
+
+    CPU_ZERO(&ProcessMask);
+    if (sched_getaffinity(0, sizeof(ProcessMask), &ProcessMask))
+        return { {} };
+
+    for (int n = 0; ; ++n) {
+        ifstream f("/sys/devices/system/node/node" + to_string(n) + "/cpulist");
+        if (!f || !getline(f, list))
+            break;
+
+        vector<int> cpus = parse_cpulist(list);
+        if (!cpus.empty()) // Memory only nodes, or all CPUs excluded
+            nodes.push_back(cpus);
+    }
+
+    // No sysfs, as in some containers: all the allowed CPUs in a single node
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &ProcessMask))
+                nodes.back().push_back(c);
+    }
+    return nodes;
+}
+
+#else
+
+vector<vector<int>> read_topology()
+{
+    return { {} };
+}
+
+#endif
+
+} // namespace
+
+/// The CPUs of each NUMA node, at least one node
+const vector<vector<int>>& numa_nodes()
+{
+    static const vector<vector<int>> Nodes = read_topology();
+    return Nodes;
+}
+
+/// The node of pool's thread id
+size_t numa_node_of(size_t id)
+{
+    return id % numa_nodes().size();
+}
+
+/// Pin the calling thread, that is pool's thread id, to its CPU. Return false
+/// if not supported. Memory first touched by the thread afterwards is then
+/// allocated on its node by the default policy of the OS.
+bool numa_pin(size_t id)
+{
+    const vector<int>& cpus = numa_nodes()[numa_node_of(id)];
+
+    if (cpus.empty())
+        return false;
+
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpus[(id / numa_nodes().size()) % cpus.size()], &mask);
+    return !sched_setaffinity(0, sizeof(mask), &mask);
+#else
+    return false;
+#endif
+}
+
+/// Let the calling thread run again on any of the process' CPUs
+void numa_unpin()
+{
+#ifdef __linux__
+    if (!numa_nodes()[0].empty())
+        sched_setaffinity(0, sizeof(ProcessMask), &ProcessMask);
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef NUMA_H_INCLUDED
+#define NUMA_H_INCLUDED
+
+#include <cstddef>
+#include <vector>
+
+extern const std::vector<std::vector<int>>& numa_nodes();
+extern size_t numa_node_of(size_t id);
+extern bool numa_pin(size_t id);
+extern void numa_unpin();
+
+#endif // #ifndef NUMA_H_INCLUDED
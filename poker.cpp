@@ -3,6 +3,9 @@
 #include <cstring>
 #include <ctype.h>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <set>
 #include <sstream>
 #include <string>
@@ -13,6 +16,17 @@ using namespace std;
 
 namespace {
 
+// Games played at once out of a full enumeration
+constexpr size_t EnumBlock = 16 * MAX_BATCH;
+
+// Scores of the players with given hole cards cached in full enumeration. With
+// SIMD scoring a lookup is not cheaper than scoring again: the cache is off.
+#if defined(USE_AVX512) || defined(USE_AVX2)
+constexpr size_t MaxCachedScores = 0;
+#else
+constexpr size_t MaxCachedScores = 1 << 16;
+#endif
+
 const string Values = "23456789TJQKA";
 const string Suites = "dhcs";
 const string SO = "so";
@@ -139,45 +153,92 @@ bool expand(const string& token, HandSet& ranges)
     return true;
 }
 
-} // namespace
-
 // Parse a string token with a list of ranges like '[AK,88+,76s+]' or a single
 // one like 'QQ+' into a set of hands, each one of 2 hole cards.
-bool Spot::parse_range(const string& token, int player)
+RangePtr parse_range(const string& token)
 {
     bool hasBrackets = (token.front() == '[' && token.back() == ']');
     bool isList = (token.find(",") != string::npos);
     if (!hasBrackets && isList)
-        return false;
+        return nullptr;
 
     string combo;
     HandSet handSet(key_compare); // Use a set to avoid duplicates
-    size_t cnt = 0;
     stringstream ss(hasBrackets ? token.substr(1, token.size() - 2) : token);
 
     while (std::getline(ss, combo, ','))
         if (!expand(combo, handSet))
-            return false;
+            return nullptr;
 
     if (handSet.empty() || handSet.size() > MAX_RANGE)
-        return false;
+        return nullptr;
+
+    // Each combo is stored once. At simulation time a random index picks the
+    // combo through pick[], an index of 9 bits up to 512 combos, of 11 bits
+    // above. Indices beyond the last full multiple of the range size are
+    // rejected, so that all the combos are equally likely.
+    auto r = std::make_shared<Range>();
+    r->token = token;
+    r->combos.assign(handSet.begin(), handSet.end());
+    r->bits = r->combos.size() > 512 ? 11 : 9;
+    r->pick.resize(1 << r->bits);
+
+    size_t k = r->combos.size(), end = k * (r->pick.size() / k);
+    for (size_t i = 0; i < r->pick.size(); ++i)
+        r->pick[i] = i < end ? uint16_t(i % k) : NO_COMBO;
+
+    // Combos are sorted by cards, as in the set, so look up the permuted ones
+    r->symmetries = 0;
+    for (int i = 0; i < 24; ++i) {
+        bool ok = true;
+        for (size_t j = 0; ok && j < k; ++j) {
+            uint64_t h = permute_suits(r->combos[j].cards, SuitPerms[i]);
+            ok = std::binary_search(r->combos.begin(), r->combos.end(), Hand{0, h, 0},
+                                    key_compare);
+        }
+        r->symmetries |= uint32_t(ok) << i;
+    }
+    return r;
+}
+
+} // namespace
 
-    // Duplicate the handset into multiple full copies in combos[]. We will pick
-    // randomly from there at simulation time.
-    for (size_t i = 0; i < MAX_RANGE / handSet.size(); ++i)
-        for (const Hand& h : handSet)
-            combos[player][cnt++] = h;
+/// All the permutations of the 4 suits, in lexicographic order: the identity
+/// is the first one.
+const uint8_t SuitPerms[24][4] = {
+    { 0, 1, 2, 3 }, { 0, 1, 3, 2 }, { 0, 2, 1, 3 }, { 0, 2, 3, 1 },
+    { 0, 3, 1, 2 }, { 0, 3, 2, 1 }, { 1, 0, 2, 3 }, { 1, 0, 3, 2 },
+    { 1, 2, 0, 3 }, { 1, 2, 3, 0 }, { 1, 3, 0, 2 }, { 1, 3, 2, 0 },
+    { 2, 0, 1, 3 }, { 2, 0, 3, 1 }, { 2, 1, 0, 3 }, { 2, 1, 3, 0 },
+    { 2, 3, 0, 1 }, { 2, 3, 1, 0 }, { 3, 0, 1, 2 }, { 3, 0, 2, 1 },
+    { 3, 1, 0, 2 }, { 3, 1, 2, 0 }, { 3, 2, 0, 1 }, { 3, 2, 1, 0 }
+};
 
-    // Fill remaining entries with COMBO_EOF
-    Hand invalid = Hand();
-    invalid.cards = COMBO_EOF;
-    while (cnt < MAX_RANGE)
-        combos[player][cnt++] = invalid;
+/// Return the range of a string token, parsing it only the first time. Parsed
+/// ranges are kept in a cache shared by all the threads, so that spots that
+/// repeat the same ranges, as in server mode, skip parsing altogether.
+RangePtr get_range(const string& token)
+{
+    constexpr size_t MaxCached = 4096;
+    static std::mutex mutex;
+    static std::map<string, RangePtr> cache;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(token);
+        if (it != cache.end())
+            return it->second;
+    }
 
-    cout << "Set range " << token << " for player " << player + 1
-         << " of size: " << handSet.size() << endl;
+    RangePtr r = parse_range(token);
+    if (!r)
+        return nullptr;
 
-    return true;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cache.size() >= MaxCached)
+        cache.clear();
+
+    return cache.emplace(token, r).first->second;
 }
 
 /// Initialize a Spot from a given string like:
@@ -185,62 +246,124 @@ bool Spot::parse_range(const string& token, int player)
 ///  4P AcTc TdTh - 5h 6h 9c
 ///  3P [AA,QQ-99,AKs,T7s-T3s,AKo] [88+,T6s+,52o+] TT+
 ///
-Spot::Spot(int playersNum, const std::string& pos)
+/// In street mode the common cards after the flop, in the given order, are the
+/// turn and the river, see Spot::run_streets().
+Spot::Spot(int playersNum, const std::string& pos, bool streets)
 {
-    Hand all = Hand();
+    uint64_t holes[PLAYERS_NB] = {};
+    RangePtr holeRanges[PLAYERS_NB];
+    Hand all = Hand(), h;
     string token;
     stringstream ss(pos);
 
-    if (playersNum < 2 || playersNum > 9)
+    ready = false;
+    ss >> skipws;
+
+    // First hole cards, one token per player. Token can be single card, double
+    // card, range or range list. The latter between square brackets [].
+    int n = -1;
+    while (ss >> token && token != "-") {
+        if (++n >= PLAYERS_NB)
+            return;
+
+        h = Hand();
+        if (parse_cards(token, h, all, 2))
+            holes[n] = h.cards;
+
+        else if (!(holeRanges[n] = get_range(token)))
+            return;
+    }
+
+    // Then remaining common cards up to 5, one by one to keep their order
+    uint64_t board[5] = {};
+    int cnt = 0;
+    h = Hand();
+    while (ss >> token)
+        for (size_t i = 0; i < token.length(); i += 2) {
+            uint64_t prev = h.cards;
+            if (!parse_cards(token.substr(i, 2), h, all, 5))
+                return;
+            board[cnt++] = h.cards ^ prev;
+        }
+
+    if (!streets)
+        init(playersNum, holes, holeRanges, h.cards, 0, 0);
+
+    else if (cnt >= 3)
+        init(playersNum, holes, holeRanges, board[0] | board[1] | board[2],
+             board[3], board[4]);
+}
+
+/// Initialize a Spot out of card bitmasks, with no parsing: holes[] and
+/// holeRanges[] have PLAYERS_NB entries, each player has either up to 2 given
+/// hole cards or a range, the ones with none are dealt at random. This is the
+/// fast path when spots are built programmatically. If a turn card is given,
+/// the commons are the flop and the spot runs in street mode.
+void Spot::init(int playersNum, const uint64_t holes[], const RangePtr holeRanges[],
+                uint64_t commons, uint64_t turn, uint64_t river)
+{
+    uint64_t all = commons | turn | river;
+
+    ready = false;
+
+    if (   playersNum < 2 || playersNum > PLAYERS_NB
+        || popcount(commons) > 5 || (all & FlagsArea)
+        || (turn && (popcount(commons) != 3 || popcount(turn) != 1))
+        || (river && (!turn || popcount(river) != 1))
+        || popcount(all) != popcount(commons) + !!turn + !!river)
         return;
 
+    streetCards[0] = turn;
+    streetCards[1] = river;
+    numStreets = 1 + !!turn + !!river;
+
     memset(givenHoles, 0, sizeof(givenHoles));
 
     numPlayers = playersNum;
     givenCommon = Hand();
     givenCommon.suits = SuitInit; // Only givenCommon is set with SuitInit
-    prng = nullptr;
     enumMask = rangeMask = 0;
-    ready = false;
 
-    ss >> skipws;
+    int *mi = missingHolesId, *ci = combosId;
+    for (int i = 0; i < PLAYERS_NB; ++i) {
+        uint64_t b = holes[i];
 
-    // First hole cards, one token per player. Token can be single card, double
-    // card, range or range list. The latter between square brackets [].
-    int n = -1, *mi = missingHolesId, *ci = combosId;
-    while (ss >> token && token != "-") {
-        if (   !parse_cards(token, givenHoles[++n], all, 2)
-            && !parse_range(token, n))
+        if (   popcount(b) > 2 || (b & (all | FlagsArea))
+            || ((b || holeRanges[i]) && (i >= playersNum || (b && holeRanges[i]))))
             return;
 
+        all |= b;
+        ranges[i] = holeRanges[i];
+        while (b)
+            givenHoles[i].add(Card(pop_lsb(&b)), 0);
+
         // Add to missingHolesId[] the hole's index for the missing card
         // and update enumMask setting this hole's group boundary.
-        if (popcount(givenHoles[n].cards) == 1) {
-            *mi++ = n;
+        if (popcount(holes[i]) == 1) {
+            *mi++ = i;
             enumMask = (enumMask << 1) | 1;
             rangeMask <<= 1;
         }
-        // In case of a range givenHoles[n] remains empty, so add to combosId[]
+        // In case of a range givenHoles[i] remains empty, so add to combosId[]
         // the range index to pick from at simulation time.
-        else if (!givenHoles[n].cards) {
-            *ci++ = n;
+        else if (ranges[i]) {
+            *ci++ = i;
             enumMask  = (enumMask  << 2) | 2;
             rangeMask = (rangeMask << 2) | 2;
         }
     }
     // Populate missingHolesId[] and enumMask for the missing hole card pairs
-    // up to the number of given players.
-    for (int i = n + 1; i < int(numPlayers); ++i) {
-        *mi++ = i, *mi++ = i;
-        enumMask = (enumMask << 2) | 2;
-        rangeMask <<= 2;
-    }
+    // of the given players, after all the others.
+    for (int i = 0; i < playersNum; ++i)
+        if (!holes[i] && !ranges[i]) {
+            *mi++ = i, *mi++ = i;
+            enumMask = (enumMask << 2) | 2;
+            rangeMask <<= 2;
+        }
     *mi = -1, *ci = -1; // Set EOF
 
-    // Then remaining common cards up to 5
-    while (ss >> token)
-        if (!parse_cards(token, givenCommon, all, 5))
-            return;
+    while (commons)
+        givenCommon.add(Card(pop_lsb(&commons)), 0);
 
     missingCommons = 5 - popcount(givenCommon.cards);
     if (missingCommons) {
@@ -248,108 +371,591 @@ Spot::Spot(int playersNum, const std::string& pos)
         enumMask = (enumMask << missingCommons) | v;
         rangeMask <<= missingCommons;
     }
-    givenAllMask = all.cards | FlagsArea;
+    givenAllMask = (all & ~(turn | river)) | FlagsArea; // Street cards can be dealt
+
+    deckSize = 0;
+    for (unsigned c = 0; c < 64; ++c)
+        if (!(givenAllMask & (1ULL << c)) && (c & 0xF) < 13)
+            deck[deckSize++] = uint8_t(c);
+
+    deckDeals = missingCommons + unsigned(mi - missingHolesId);
+    deckDealer = false;
+    evaluator = EV_BITBOARD;
+    init_suit_perms();
+    init_texture();
+    init_kernel();
     ready = true;
 }
 
-/// Run a single spot and update results vector. First generate hole cards for
-/// given ranges, then common cards, then free hole cards. Finally score the
-/// hands and find the max among them.
-void Spot::run(Result results[])
+/// Find the suit permutations that map the spot onto itself: given common cards
+/// and given hole cards of each player should stay the same, while each range
+/// should be closed under the permutation. Deals mapped one onto the other by
+/// these permutations have the same results, so full enumeration can play just
+/// one of them. The identity is always the first one.
+void Spot::init_suit_perms()
 {
-    Hand hands[PLAYERS_NB];
-    unsigned maxId = 0, split = 0;
-    uint64_t maxScore = 0;
-    Hand common = givenCommon;
-    uint64_t allMask = givenAllMask;
+    uint32_t symmetries = ~0U;
+    permsNum = 0;
+
+    for (const int* ci = combosId; *ci != -1; ++ci)
+        symmetries &= ranges[*ci]->symmetries;
+
+    for (int i = 0; i < 24; ++i) {
+        const uint8_t* p = SuitPerms[i];
+
+        bool ok = (symmetries >> i) & 1;
+        ok = ok && (permute_suits(givenCommon.cards, p) == givenCommon.cards);
+
+        for (unsigned s = 1; ok && s < numStreets; ++s)
+            ok = (permute_suits(streetCards[s - 1], p) == streetCards[s - 1]);
+
+        for (unsigned j = 0; ok && j < numPlayers; ++j)
+            ok = (permute_suits(givenHoles[j].cards, p) == givenHoles[j].cards);
+
+        if (ok)
+            memcpy(suitPerms[permsNum++], p, sizeof(suitPerms[0]));
+    }
+}
 
-    // First generate givenHoles instances out of the given ranges, if any
+/// Find which combinations the board can make in any game of the spot. A flush
+/// needs at least 3 common cards of the same suit and a straight at least 3
+/// common cards of different values in a span of 5, counting the missing common
+/// cards as the ones that fit. When the given common cards rule out both, as
+/// in many turn and river spots, all the hands are scored skipping the checks.
+void Spot::init_texture()
+{
+    uint64_t b = givenCommon.cards;
+    unsigned t = TX_PLAIN;
+
+    for (uint64_t r : RanksBB)
+        if (popcount(b & r) + missingCommons >= 3)
+            t |= TX_FLUSH;
+
+    b = (b | (b >> 16) | (b >> 32) | (b >> 48)) & 0x1FFF;
+    b = (b << 1) | (b >> 12); // Duplicate an ace into first position
+
+    for (int i = 0; i <= 13 - 4; ++i)
+        if (popcount(b & (0x1FULL << i)) + missingCommons >= 3)
+            t |= TX_STRAIGHT;
+
+    texture = Texture(t);
+}
+
+/// Streaming state of a full enumeration: games are buffered in blocks and
+/// played by Spot::play_block() when the block is full.
+struct Spot::EnumState {
+    State& state;
+    std::vector<uint64_t>& buf;
+    Result* results;
+    size_t entries;   // Number of uint64_t in buf for a single game
+    size_t blockSize; // Number of uint64_t in buf for a full block of games
+    uint64_t allMask; // Spot::givenAllMask plus the cards enumerated so far
+    uint64_t groupBase; // Cards dealt before the current group
+    uint32_t active; // Suit permutations that map the dealt groups onto themselves
+    size_t orbits; // Number of deals the played ones stand for
+    unsigned weights[EnumBlock];
+};
+
+/// Pick the hole cards of the given ranges, if any, rejecting the combos that
+/// clash with the cards already dealt. Return the mask of all of them.
+template<typename Source>
+uint64_t Spot::pick_ranges(Source& src, Hand picked[]) const
+{
+    uint64_t allMask = givenAllMask;
     const int* ci = combosId;
+
     while (*ci != -1) {
-        uint64_t n = prng->next();
-        for (unsigned i = 0; i <= 64 - 9; i += 9) {
-            givenHoles[*ci] = combos[*ci][(n >> i) & 0x1FF];
-            if (givenHoles[*ci].cards & allMask)
+        uint64_t n = src.next();
+        for (unsigned i = 0; i + ranges[*ci]->bits <= 64; ) {
+            const Range& r = *ranges[*ci];
+            unsigned idx = r.pick[(n >> i) & ((1U << r.bits) - 1)];
+            i += r.bits;
+            if (idx == NO_COMBO || (r.combos[idx].cards & allMask)) {
+                STATS(Perf.rejected++);
                 continue;
-            allMask |= givenHoles[*ci].cards;
+            }
+            STATS(Perf.dealt++);
+            picked[*ci] = r.combos[idx];
+            allMask |= picked[*ci].cards;
             if (*(++ci) == -1)
                 break;
         }
     }
+    return allMask;
+}
+
+/// Deal a single game: first generate hole cards for given ranges, then common
+/// cards, then free hole cards. On return hands[] are ready to be scored.
+template<int P, int C, typename Source>
+void Spot::deal(State& st, Source& src, Hand hands[]) const
+{
+    const unsigned players = P > 0 ? P : numPlayers;
+    Hand common = givenCommon;
+    Hand picked[PLAYERS_NB];
+    uint64_t allMask = pick_ranges(src, picked);
 
     // Then complete the common 5-card board
-    unsigned cnt = missingCommons;
+    unsigned cnt = C >= 0 ? C : missingCommons;
     while (cnt) {
-        uint64_t n = prng->next();
-        for (unsigned i = 0; i <= 64 - 6; i += 6)
-            if (common.add(Card((n >> i) & 0x3F), allMask) && --cnt == 0)
+        uint64_t n = src.next();
+        for (unsigned i = 0; i <= 64 - 6; i += 6) {
+            if (!common.add(Card((n >> i) & 0x3F), allMask)) {
+                STATS(Perf.rejected++);
+                continue;
+            }
+            STATS(Perf.dealt++);
+            if (--cnt == 0) {
+                st.lastCommon = Card((n >> i) & 0x3F);
                 break;
+            }
+        }
     }
 
-    for (unsigned i = 0; i < numPlayers; ++i) {
+    // Players with a range have no given holes, merge the picked ones
+    for (unsigned i = 0; i < players; ++i) {
         hands[i] = common;
         hands[i].merge(givenHoles[i]);
     }
+    for (const int* ci = combosId; *ci != -1; ++ci)
+        hands[*ci].merge(picked[*ci]);
 
-    // Finally fill the missing hole cards (single or double)
+    // Finally fill the missing hole cards (single or double), that should not
+    // clash with the ones of the other players too.
     const int* mi = missingHolesId;
     while (*mi != -1) {
-        uint64_t n = prng->next();
+        uint64_t n = src.next();
         for (unsigned i = 0; i <= 64 - 6; i += 6)
-            if (hands[*mi].add(Card((n >> i) & 0x3F), allMask) && *(++mi) == -1)
-                break;
+            if (hands[*mi].add(Card((n >> i) & 0x3F), allMask)) {
+                STATS(Perf.dealt++);
+                allMask |= 1ULL << ((n >> i) & 0x3F);
+                if (*(++mi) == -1)
+                    break;
+            } else
+                STATS(Perf.rejected++);
+    }
+}
+
+/// Same as deal(), but with no rejections: cards are dealt out of live[], a
+/// permutation of the deck, with a partial Fisher-Yates shuffle. The i-th card
+/// is swapped with a random one among the ones not dealt yet, so each game
+/// takes the same randoms, fetched at once with PRNG::fill(). An index in
+/// [0, range) is the high part of a 64 bit random times range, and the low
+/// part is the random for the next index, so a random gives DeckDraws indices
+/// with a bias below 2^-40. The deck is left shuffled, that is as good as any
+/// other order to start the next game. Ranges are still picked by rejection,
+/// and their cards are swapped out of the live deck when drawn, at the cost
+/// of a draw.
+template<int P, int C>
+void Spot::deal_deck(State& st, uint8_t live[], Hand hands[]) const
+{
+    constexpr unsigned DeckDraws = 4;
+
+    const unsigned players = P > 0 ? P : numPlayers;
+    const unsigned commons = C >= 0 ? C : missingCommons;
+
+    Hand common = givenCommon;
+    Hand picked[PLAYERS_NB];
+    uint64_t allMask = pick_ranges(*st.prng, picked);
+    uint64_t rnd[(5 + PLAYERS_NB * HOLE_NB) / DeckDraws + 1], r = 0;
+    unsigned words = (deckDeals + DeckDraws - 1) / DeckDraws;
+    unsigned i = 0, k = 0, size = deckSize;
+
+    st.prng->fill(rnd, words);
+
+    auto draw = [&]() {
+        while (true) {
+            if (k % DeckDraws == 0)
+                r = k < words * DeckDraws ? rnd[k / DeckDraws] : st.prng->next();
+            k++;
+
+            // 64 x 32 bit product of r and the range, in two halves
+            uint64_t lo = (r & 0xFFFFFFFF) * (size - i);
+            uint64_t hi = (r >> 32) * (size - i) + (lo >> 32);
+            unsigned j = i + unsigned(hi >> 32);
+            r = (hi << 32) | (lo & 0xFFFFFFFF);
+
+            uint8_t c = live[j];
+            if (!(allMask & (1ULL << c))) {
+                STATS(Perf.dealt++);
+                live[j] = live[i], live[i++] = c;
+                return Card(c);
+            }
+            STATS(Perf.rejected++);
+            live[j] = live[--size], live[size] = c; // Taken by a range
+        }
+    };
+
+    for (unsigned n = 0; n < commons; ++n)
+        common.add(st.lastCommon = draw(), 0);
+
+    for (unsigned p = 0; p < players; ++p) {
+        hands[p] = common;
+        hands[p].merge(givenHoles[p]);
+    }
+    for (const int* ci = combosId; *ci != -1; ++ci)
+        hands[*ci].merge(picked[*ci]);
+
+    for (const int* mi = missingHolesId; *mi != -1; ++mi)
+        hands[*mi].add(draw(), 0);
+}
+
+namespace {
+
+// Find the best score of each of the n games, how many players share it, and
+// add the outcome to the results, each game counting as weight[g] games. The
+// number of players is P, if not -1.
+template<int P>
+void add_results(uint64_t score[][MAX_BATCH], unsigned playersNum, size_t n,
+                 const unsigned weight[], Result results[])
+{
+    const unsigned players = P > 0 ? P : playersNum;
+
+    // Tie share indexed by the number of players with the best score. Split
+    // by a single player is a win, counted apart.
+    constexpr unsigned TieShare[] = { 0, 0, KTie / 2, KTie / 3, KTie / 4, KTie / 5,
+                                      KTie / 6, KTie / 7, KTie / 8, KTie / 9 };
+
+    uint64_t maxScore[MAX_BATCH];
+    unsigned split[MAX_BATCH];
+
+    for (size_t g = 0; g < n; ++g)
+        maxScore[g] = score[0][g];
+
+    for (unsigned i = 1; i < players; ++i)
+        for (size_t g = 0; g < n; ++g)
+            maxScore[g] = std::max(maxScore[g], score[i][g]);
+
+    memset(split, 0, sizeof(split));
+    for (unsigned i = 0; i < players; ++i)
+        for (size_t g = 0; g < n; ++g)
+            split[g] += (score[i][g] == maxScore[g]);
+
+    for (unsigned i = 0; i < players; ++i) {
+        uint64_t won = 0, tied = 0;
+        for (size_t g = 0; g < n; ++g) {
+            bool best = (score[i][g] == maxScore[g]);
+            won  += best && split[g] == 1 ? weight[g] : 0;
+            tied += best ? TieShare[split[g]] * weight[g] : 0;
+        }
+        results[i].first += won;
+        results[i].second += tied;
+    }
+}
+
+} // namespace
+
+/// Run n games in blocks of MAX_BATCH games and update results vector. Games
+/// are dealt one by one, but stored in structure of arrays layout, one row per
+/// player, so that scoring and winner selection work across the games of the
+/// block, instead of across the few players of a single game. Results are
+/// exactly the same whatever the kernel run_batch() calls. If weights are
+/// given, each game counts as weights[g] games, as needed by full enumeration.
+/// In street mode the games are played also on the turn and on the river.
+/// This is the kernel that run_batch() calls for spots of P players and C
+/// missing common cards, see init_kernel().
+template<int P, int C>
+void Spot::batch_kernel(State& st, size_t n, Result results[], const unsigned weights[]) const
+{
+    if (deckDealer) {
+        uint8_t live[DECK_NB];
+        std::copy(deck, deck + deckSize, live);
+        auto dealer = [&](Hand hands[]) { deal_deck<P, C>(st, live, hands); };
+        play_batch<P>(st, dealer, n, results, weights);
+    } else {
+        auto dealer = [&](Hand hands[]) { deal<P, C>(st, *st.prng, hands); };
+        play_batch<P>(st, dealer, n, results, weights);
+    }
+}
+
+/// The body of run_batch(), with each game dealt by dealer: out of the PRNG,
+/// out of the deck, or in full enumeration out of the enumerated games.
+template<int P, typename Dealer>
+void Spot::play_batch(State& st, Dealer& dealer, size_t n, Result results[],
+                      const unsigned weights[]) const
+{
+    const unsigned players = P > 0 ? P : numPlayers;
+    uint64_t score[PLAYERS_NB][MAX_BATCH], cards[PLAYERS_NB][MAX_BATCH];
+    uint32_t suits[PLAYERS_NB][MAX_BATCH];
+    uint64_t boards[MAX_BATCH];
+    unsigned weight[MAX_BATCH];
+    Card last[MAX_BATCH];
+    Hand hands[PLAYERS_NB];
+
+    std::fill(weight, weight + MAX_BATCH, 1);
+
+    while (n) {
+        size_t cnt = std::min(n, size_t(MAX_BATCH));
+        n -= cnt;
+
+        if (weights) {
+            std::copy(weights, weights + cnt, weight);
+            weights += cnt;
+        }
+
+        STATS(Perf.dealTime -= now_ns());
+
+        for (size_t g = 0; g < cnt; ++g) {
+            dealer(hands);
+            for (unsigned i = 0; i < players; ++i) {
+                score[i][g] = hands[i].score;
+                cards[i][g] = hands[i].cards;
+                suits[i][g] = hands[i].suits;
+            }
+            // The board is made of the cards that all the players share
+            boards[g] = hands[0].cards & hands[1].cards;
+            last[g] = st.lastCommon;
+        }
+
+        STATS(Perf.dealTime += now_ns());
+        STATS(Perf.evalTime -= now_ns());
+
+        for (unsigned i = 0; i < players; ++i)
+            if (st.scoreCache && !ranges[i] && popcount(givenHoles[i].cards) == 2)
+                score_known(*st.scoreCache, score[i], cards[i], suits[i], cnt);
+            else
+                score_hands(score[i], cards[i], suits[i], cnt, texture, evaluator);
+
+        add_results<P>(score, players, cnt, weight, results);
+
+        if (st.stats)
+            collect_stats(*st.stats, cnt, score, cards, last, weight);
+
+        if (numStreets > 1)
+            run_streets(cnt, cards, boards, last, weight, weights != nullptr, results);
+
+        STATS(Perf.evalTime += now_ns());
     }
+}
+
+/// The kernel of run_batch() for P players, by the number of missing common
+/// cards: none, the river, the turn and the river, or the whole board.
+template<int P>
+Spot::BatchKernel Spot::kernel_of() const
+{
+    switch (missingCommons) {
+    case 0:  return &Spot::batch_kernel<P, 0>;
+    case 1:  return &Spot::batch_kernel<P, 1>;
+    case 2:  return &Spot::batch_kernel<P, 2>;
+    case 5:  return &Spot::batch_kernel<P, 5>;
+    default: return &Spot::batch_kernel<P, -1>;
+    }
+}
 
-    // Now we are ready to score hands and find the winner
-    for (unsigned i = 0; i < numPlayers; ++i) {
-        hands[i].do_score();
-        if (maxScore < hands[i].score) {
-            maxScore = hands[i].score;
-            maxId = i;
-            split = 0;
-        } else if (maxScore == hands[i].score)
-            split++;
+/// Pick the kernel of run_batch() once, when the spot is built. In heads-up
+/// and 3-way spots, preflop, on the flop, on the turn and on the river, the
+/// number of players and of missing common cards are compile time constants,
+/// so that loops on the players are unrolled and the ones on the missing common
+/// cards are straight code. Other spots take the generic kernel: with more
+/// players the scoring dominates and the specialized kernels were not
+/// measurably faster, only larger.
+void Spot::init_kernel()
+{
+    switch (numPlayers) {
+    case 2:  batchKernel = kernel_of<2>(); break;
+    case 3:  batchKernel = kernel_of<3>(); break;
+    default: batchKernel = &Spot::batch_kernel<-1, -1>; break;
     }
+}
 
-    if (!split)
-        results[maxId].first++;
-    else
-        for (unsigned i = 0; i < numPlayers; ++i) {
-            if (hands[i].score == maxScore)
-                results[i].second += KTie / (split + 1);
+/// Add the games of a batch to the hand statistics. In turn spots the hands
+/// are scored again without the river, to find who is ahead on the turn.
+void Spot::collect_stats(HandStats& stats, size_t n, uint64_t score[][MAX_BATCH],
+                         uint64_t cards[][MAX_BATCH], const Card last[],
+                         const unsigned weight[]) const
+{
+    for (unsigned i = 0; i < numPlayers; ++i)
+        for (size_t g = 0; g < n; ++g)
+            stats.categories[i][category(score[i][g])] += weight[g];
+
+    if (missingCommons != 1)
+        return;
+
+    uint64_t turnScore[PLAYERS_NB][MAX_BATCH], turnCards[PLAYERS_NB][MAX_BATCH];
+    uint32_t turnSuits[PLAYERS_NB][MAX_BATCH];
+    uint64_t maxTurn[MAX_BATCH], maxRiver[MAX_BATCH];
+
+    for (unsigned i = 0; i < numPlayers; ++i)
+        for (size_t g = 0; g < n; ++g) {
+            Hand h = givenCommon;
+            uint64_t b = cards[i][g] & ~(givenCommon.cards | (1ULL << last[g]));
+            while (b)
+                h.add(Card(pop_lsb(&b)), 0);
+
+            turnScore[i][g] = h.score;
+            turnCards[i][g] = h.cards;
+            turnSuits[i][g] = h.suits;
         }
+
+    for (unsigned i = 0; i < numPlayers; ++i)
+        score_hands(turnScore[i], turnCards[i], turnSuits[i], n, texture, evaluator);
+
+    std::fill(maxTurn, maxTurn + n, 0);
+    std::fill(maxRiver, maxRiver + n, 0);
+
+    for (unsigned i = 0; i < numPlayers; ++i)
+        for (size_t g = 0; g < n; ++g) {
+            maxTurn[g] = std::max(maxTurn[g], turnScore[i][g]);
+            maxRiver[g] = std::max(maxRiver[g], score[i][g]);
+        }
+
+    // A player behind on the turn that wins, or splits, the pot on the river
+    for (size_t g = 0; g < n; ++g) {
+        bool flip = false;
+
+        for (unsigned i = 0; i < numPlayers; ++i)
+            if (score[i][g] == maxRiver[g] && turnScore[i][g] < maxTurn[g]) {
+                stats.outs[i][last[g]] += weight[g];
+                flip = true;
+            }
+
+        stats.riverGames[last[g]] += weight[g];
+        stats.flips[last[g]] += flip ? weight[g] : 0;
+    }
+}
+
+/// In street mode the games dealt on the flop go on to the turn and to the
+/// river, instead of running a new simulation for each street. A game with a
+/// street card among the dealt hole cards can't reach that street and is
+/// skipped. Otherwise the river is the given board, while on the turn, the
+/// missing river is the last card dealt to the flop, or the other one if it's
+/// the turn card: this picks each remaining card with the same probability.
+/// In full enumeration instead, only the runouts that include the street cards
+/// are kept, so that results are exact. Results of street s are stored after
+/// the ones of street s - 1.
+void Spot::run_streets(size_t n, uint64_t cards[][MAX_BATCH], const uint64_t boards[],
+                       const Card last[], const unsigned weight[], bool exact,
+                       Result results[]) const
+{
+    uint64_t score[PLAYERS_NB][MAX_BATCH], hands[PLAYERS_NB][MAX_BATCH];
+    uint32_t suits[PLAYERS_NB][MAX_BATCH];
+    unsigned w[MAX_BATCH];
+    uint64_t turn = streetCards[0];
+
+    for (unsigned s = 1; s < numStreets; ++s) {
+        uint64_t fixed = turn | (s == 2 ? streetCards[1] : 0);
+        size_t cnt = 0;
+
+        for (size_t g = 0; g < n; ++g) {
+            uint64_t runout = boards[g] & ~givenCommon.cards;
+            uint64_t holes = 0;
+
+            for (unsigned i = 0; i < numPlayers; ++i)
+                holes |= cards[i][g] & ~boards[g];
+
+            if ((holes & fixed) || (exact && (runout & fixed) != fixed))
+                continue;
+
+            uint64_t river = 1ULL << last[g];
+            river = (s == 2) ? streetCards[1] : river != turn ? river : runout ^ river;
+
+            Hand board = givenCommon;
+            board.add(Card(lsb(turn)), 0);
+            board.add(Card(lsb(river)), 0);
+
+            for (unsigned i = 0; i < numPlayers; ++i) {
+                Hand h = board;
+                uint64_t b = cards[i][g] & ~boards[g];
+                while (b)
+                    h.add(Card(pop_lsb(&b)), 0);
+
+                score[i][cnt] = h.score;
+                hands[i][cnt] = h.cards;
+                suits[i][cnt] = h.suits;
+            }
+            w[cnt++] = weight[g];
+        }
+
+        for (unsigned i = 0; i < numPlayers; ++i)
+            score_hands(score[i], hands[i], suits[i], cnt, texture, evaluator);
+
+        add_results<-1>(score, numPlayers, cnt, w, results + s * numPlayers);
+    }
+}
+
+/// Scores of the players with given hole cards, memoized by their 7 cards in a
+/// direct-mapped table. In full enumeration the boards come back for each
+/// combination of the other players' cards, and with them the same scores.
+struct Spot::ScoreCache {
+    struct Entry {
+        uint64_t cards, score;
+    };
+    std::vector<Entry> table;
+    unsigned shift;
+
+    Entry& entry(uint64_t cards) {
+        return table[size_t((cards * 0x9E3779B97F4A7C15ULL) >> shift)];
+    }
+};
+
+/// Same as score_hands(), but for the hands of a player with given hole cards:
+/// take the scores found in the cache and score only the missing ones, then
+/// add them to the cache. An empty entry never matches, it has no cards.
+void Spot::score_known(ScoreCache& cache, uint64_t score[], const uint64_t cards[],
+                       const uint32_t suits[], size_t n) const
+{
+    uint64_t missScore[MAX_BATCH], missCards[MAX_BATCH];
+    uint32_t missSuits[MAX_BATCH];
+    size_t missId[MAX_BATCH], m = 0;
+
+    for (size_t g = 0; g < n; ++g) {
+        const ScoreCache::Entry& e = cache.entry(cards[g]);
+        if (e.cards == cards[g]) {
+            score[g] = e.score;
+            continue;
+        }
+        missId[m] = g;
+        missScore[m] = score[g];
+        missCards[m] = cards[g];
+        missSuits[m++] = suits[g];
+    }
+
+    if (!m)
+        return;
+
+    score_hands(missScore, missCards, missSuits, m, texture, evaluator);
+
+    for (size_t k = 0; k < m; ++k) {
+        score[missId[k]] = missScore[k];
+        cache.entry(missCards[k]) = { missCards[k], missScore[k] };
+    }
 }
 
 /// Recursively compute all possible combinations (not permutations) of missing
 /// cards for each hole group and common cards. Then add the cards to enumBuf
-/// from where Spot::run() will fetch instead of using the PRNG. We push one
+/// from where Spot::deal() will fetch instead of using the PRNG. We push one
 /// uint64_t (that can pack up to 10 cards) for the missing commons cards and
-/// one for the missing hole cards.
-void Spot::enumerate(std::vector<uint64_t>& buf, unsigned missing,
+/// one for the missing hole cards. As soon as enumBuf holds a full block of
+/// games, they are played and enumBuf is emptied. Deals that are not canonical
+/// under suit isomorphism are skipped, the canonical ones are weighted by the
+/// number of deals they stand for.
+void Spot::enumerate(EnumState& st, unsigned missing,
                      uint64_t rnd64[], int shift[], int limit,
-                     size_t idx, size_t threadsNum)
+                     size_t idx, size_t threadsNum) const
 {
     // At group boundaries enumMask is 1. We reset to 64 in this case
     uint32_t groupBoundary = enumMask & (1 << (missing - 1));
     unsigned end = groupBoundary ? 64 : limit;
-    Hand* cmb = nullptr;
+    const Range* range = nullptr;
 
     // Check if this new group is also a range and in this case get the
-    // corresponding combo vector.
+    // corresponding combos.
     if (groupBoundary & rangeMask) {
         // Count how many ranges there are before this one
         int cnt = popcount(rangeMask & ~(groupBoundary - 1)) - 1;
 
         assert(cnt >= 0 && combosId[cnt] != -1);
 
-        cmb = combos[combosId[cnt]];
-
-        // Look for the range's end of the first replication
-        for (end = 1; end < MAX_RANGE; ++end)
-            if (cmb[end].cards == cmb[0].cards || cmb[end].cards == COMBO_EOF)
-                break;
+        range = ranges[combosId[cnt]].get();
+        end = unsigned(range->combos.size());
     }
-    shift[!!cmb] += (cmb ? 9 : 6);
+    bool cmb = (range != nullptr);
+    unsigned bits = cmb ? range->bits : 6;
+    int sh = shift[cmb];
+    shift[cmb] += bits;
+
+    uint64_t groupBase = st.groupBase;
+    if (groupBoundary)
+        st.groupBase = st.allMask;
 
     for (unsigned c = 0; c < end; ++c) {
 
@@ -357,67 +963,217 @@ void Spot::enumerate(std::vector<uint64_t>& buf, unsigned missing,
         if (threadsNum && idx != (c % threadsNum))
             continue;
 
-        uint64_t n = cmb ? cmb[c].cards : 1ULL << c;
+        uint64_t n = cmb ? range->combos[c].cards : 1ULL << c;
+
+        if (st.allMask & n)
+            continue;
+
+        // Once the group is complete check it against the suit permutations
+        unsigned left = missing - (cmb ? 2 : 1);
+        uint32_t active = st.active;
 
-        if (givenAllMask & n)
+        if (   (!left || (enumMask & (1 << (left - 1))))
+            && !canonical(st, (st.allMask | n) & ~st.groupBase)) {
+            st.active = active;
             continue;
+        }
+
+        rnd64[cmb] += uint64_t(c) << sh; // Append the new card/index
 
-        rnd64[!!cmb] += c << shift[!!cmb]; // Append the new card/index
+        if (!left) {
+            std::vector<uint64_t>& buf = st.buf;
+
+            // Permutations still active are the ones that leave the deal
+            // unchanged, so the deal stands for permsNum / active ones.
+            st.weights[buf.size() / st.entries] = permsNum / popcount(st.active);
 
-        if (missing == (cmb ? 2 : 1)) {
             if (rangeMask)
                 buf.push_back(rnd64[1]);
 
-            unsigned sh = shift[0] - 6 * (missingCommons - 1);
+            unsigned holesBits = shift[0] - 6 * missingCommons;
 
             if (missingCommons)
-                buf.push_back(rnd64[0] >> sh);
+                buf.push_back(rnd64[0] >> holesBits);
 
-            if (sh > 0) { // We have some missing holes
-                unsigned mask = (1 << sh) - 1;
+            if (holesBits > 0) { // We have some missing holes
+                uint64_t mask = (1ULL << holesBits) - 1;
                 buf.push_back(rnd64[0] & mask);
             }
+
+            if (buf.size() == st.blockSize)
+                play_block(st);
         } else {
-            givenAllMask |= n;
-            enumerate(buf, missing - (cmb ? 2 : 1), rnd64, shift, c, idx, 0);
-            givenAllMask ^= n;
+            st.allMask |= n;
+            enumerate(st, left, rnd64, shift, c, idx, 0);
+            st.allMask ^= n;
         }
-        rnd64[!!cmb] -= c << shift[!!cmb];
+        rnd64[cmb] -= uint64_t(c) << sh;
+        st.active = active;
+    }
+    shift[cmb] -= bits;
+    st.groupBase = groupBase;
+}
+
+/// Called by Spot::enumerate() when a group, i.e. the missing cards of a player
+/// or the missing common cards, is complete. Deals are compared group by group,
+/// so only the active permutations, the ones that map the previous groups onto
+/// themselves, can map the deal onto a smaller one, in which case the deal is
+/// not canonical and we return false. Permutations that map the group onto a
+/// bigger one are dropped from the active ones.
+bool Spot::canonical(EnumState& st, uint64_t group) const
+{
+    uint64_t b = st.active & ~1U; // Skip identity
+
+    while (b) {
+        unsigned i = pop_lsb(&b);
+        uint64_t g = permute_suits(group, suitPerms[i]);
+
+        if (g < group)
+            return false;
+
+        if (g > group)
+            st.active ^= 1U << i;
+    }
+    return true;
+}
+
+/// Play the games buffered so far by Spot::enumerate(). Spot::run_batch() works
+/// as usual, but instead of fetching cards from the PRNG, it fetches from the
+/// buffer, that is emptied at the end.
+void Spot::play_block(EnumState& st) const
+{
+    size_t n = st.buf.size() / st.entries;
+
+    EnumSource src(st.buf.data());
+    auto dealer = [&](Hand hands[]) { deal(st.state, src, hands); };
+    play_batch<-1>(st.state, dealer, n, st.results, st.weights);
+    st.buf.clear();
+    st.orbits += std::accumulate(st.weights, st.weights + n, size_t(0));
+}
+
+/// Set the canonical signature of the spot: the players and the streets, then
+/// the common cards, the street ones and the holes of each player, or a hash of
+/// the range's combos, after the suit permutation that gives the smallest one
+/// among the permutations that leave the ranges unchanged. Spots that are the
+/// same up to a renaming of the suits, so with the same exact results, have
+/// the same signature.
+void Spot::signature(uint64_t sig[SIGNATURE_NB]) const
+{
+    constexpr uint64_t RangeBit = 1ULL << 15; // In FlagsArea, never in cards
+    constexpr uint64_t Mulp = 2654435789;
+
+    uint64_t cur[SIGNATURE_NB], rangeHash[PLAYERS_NB] = {};
+    uint32_t symmetries = ~0U;
+
+    for (const int* ci = combosId; *ci != -1; ++ci) {
+        uint64_t h = 104395301;
+        for (const Hand& c : ranges[*ci]->combos)
+            h += (c.cards * Mulp) ^ (h >> 23);
+
+        rangeHash[*ci] = h | RangeBit;
+        symmetries &= ranges[*ci]->symmetries;
     }
-    shift[!!cmb] -= (cmb ? 9 : 6);
+
+    std::fill(sig, sig + SIGNATURE_NB, ~0ULL);
+
+    for (int i = 0; i < 24; ++i) {
+        if (!((symmetries >> i) & 1))
+            continue;
+
+        const uint8_t* p = SuitPerms[i];
+        uint64_t* w = cur;
+
+        std::fill(cur, cur + SIGNATURE_NB, 0);
+        *w++ = numPlayers;
+        *w++ = numStreets;
+        *w++ = permute_suits(givenCommon.cards, p);
+
+        for (unsigned s = 0; s < STREETS_NB - 1; ++s)
+            *w++ = s + 1 < numStreets ? permute_suits(streetCards[s], p) : 0;
+
+        for (unsigned j = 0; j < numPlayers; ++j)
+            *w++ = ranges[j] ? rangeHash[j] : permute_suits(givenHoles[j].cards, p);
+
+        if (std::lexicographical_compare(cur, cur + SIGNATURE_NB, sig, sig + SIGNATURE_NB))
+            std::copy(cur, cur + SIGNATURE_NB, sig);
+    }
+}
+
+/// Return true if the missing cards are few enough to be packed, as needed by
+/// Spot::enumerate(), so that the spot can be fully enumerated.
+bool Spot::can_enumerate() const
+{
+    unsigned given = popcount(givenAllMask & ~FlagsArea);
+    unsigned missing = 5 + 2 * numPlayers - given;
+    unsigned limit = 7 + 3 * popcount(rangeMask) / 2;
+    unsigned rangeBits = 0; // Range indices should fit in a single uint64_t
+
+    for (const int* ci = combosId; *ci != -1; ++ci)
+        rangeBits += ranges[*ci]->bits;
+
+    return missing <= limit && rangeBits <= 64;
 }
 
-/// Setup to run a full enumeration instead of the Monte Carlo simulation. This
-/// is possible when the number of missing cards is limited. Full enumeration is
-/// implemented in 2 steps: first all the combinations for the missing cards are
-/// computed and saved in enumBuf, then Spot::run() is called as usual, but
-/// instead of fetching cards from the PRNG, it will fetch from enumBuf. Here
-/// we implement the first step: computation of all the possible combinations.
-size_t Spot::set_enumerate(std::vector<uint64_t>& enumBuf,
-                           size_t idx, size_t threadsNum)
+/// Run a full enumeration instead of the Monte Carlo simulation. This is
+/// possible when the number of missing cards is limited. Combinations of the
+/// missing cards are computed in blocks of EnumBlock games, each block is
+/// played as soon as it is ready, so that memory use is constant however big
+/// the enumeration is. Games are split among threads at root level, by idx.
+/// Thanks to suit isomorphism, e.g. in case of missing hole cards or symmetric
+/// ranges, games played can be much fewer than the combinations they stand for.
+/// Return the number of combinations evaluated by this thread.
+size_t Spot::run_enumerate(State& state, std::vector<uint64_t>& enumBuf, size_t idx,
+                           size_t threadsNum, Result results[]) const
 {
     unsigned given = popcount(givenAllMask & ~FlagsArea);
     unsigned missing = 5 + 2 * numPlayers - given;
     unsigned missingHoles = missing - missingCommons - 2 * popcount(rangeMask);
-    unsigned limit = 5 + 3 * popcount(rangeMask) / 2;
 
     if (missing == 0)
         return 0;
 
-    if (missing > limit) {
+    if (!can_enumerate()) {
         cout << "Missing too many cards" << endl;
         return 0;
     }
-    uint64_t rnd64[] = {0, 0};
-    int shift[] = {-6, -9}; // Skip first shift
-    enumBuf.clear();
-    enumerate(enumBuf, missing, rnd64, shift, 64, idx, threadsNum);
-    size_t gamesNum = enumBuf.size();
 
     // We have 2/3 entries (instead of 1) for a single game in enumBuf in case
     // common and/or hole cards and/or ranges are missing.
-    gamesNum /= !!missingCommons + !!missingHoles + !!rangeMask;
+    size_t entries = !!missingCommons + !!missingHoles + !!rangeMask;
+
+    EnumState st = { state, enumBuf, results, entries, EnumBlock * entries,
+                     givenAllMask, 0, (1U << permsNum) - 1, 0, {} };
+    uint64_t rnd64[] = {0, 0};
+    int shift[] = {0, 0}; // Where next card/index goes
+
+    // When other cards vary, the players with given hole cards score the same
+    // boards over and over: cache their scores if all the boards fit.
+    ScoreCache cache;
+    size_t known = 0, boards = 1;
+
+    for (unsigned i = 0; i < numPlayers; ++i)
+        known += !ranges[i] && popcount(givenHoles[i].cards) == 2;
+
+    for (unsigned i = 0; i < missingCommons; ++i)
+        boards = boards * (52 - given - i) / (i + 1);
+
+    if (known && (missingHoles || rangeMask) && known * boards <= MaxCachedScores) {
+        cache.shift = unsigned(64 - std::max(msb(2 * known * boards - 1) + 1, 6));
+        cache.table.resize(size_t(1) << (64 - cache.shift));
+        state.scoreCache = &cache;
+    }
+
+    enumBuf.clear();
+    enumBuf.reserve(st.blockSize);
+
+    // Time of enumeration is what is left out of dealing and scoring the blocks
+    STATS(Perf.enumTime -= now_ns() - Perf.dealTime - Perf.evalTime);
+
+    enumerate(st, missing, rnd64, shift, 64, idx, threadsNum);
+    play_block(st); // Last one, likely not full
+
+    STATS(Perf.enumTime += now_ns() - Perf.dealTime - Perf.evalTime);
 
-    cout << "Evaluating " << gamesNum << " combinations..." << endl;
-    return gamesNum;
+    state.scoreCache = nullptr;
+    return st.orbits;
 }
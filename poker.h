@@ -3,22 +3,36 @@
 #define POKER_H_INCLUDED
 
 #include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "util.h"
 
-extern uint64_t ScoreMask[4096];
-extern void init_score_mask();
+/// The masks fixing the scores of Hand::do_score(), see util.cpp. A struct
+/// instead of a plain array, so that the compiler fills it at compile time.
+struct ScoreMaskTable {
+    uint64_t masks[4096];
+
+    constexpr uint64_t operator[](size_t idx) const { return masks[idx]; }
+};
+
+extern const ScoreMaskTable ScoreMask;
 
 enum Card : unsigned { INVALID = 13 };
 
 constexpr int PLAYERS_NB = 9;
 constexpr int HOLE_NB    = 2;
-constexpr int MAX_RANGE  = 1 << 9;
+constexpr int MAX_RANGE  = 1326; // All the possible hole cards
+constexpr int MAX_BATCH  = 64;
+constexpr int STREETS_NB = 3; // Flop, turn and river in street mode
+constexpr int DECK_NB    = 52;
+constexpr int MAX_RESULTS = PLAYERS_NB * STREETS_NB; // Results of a spot
+constexpr int SIGNATURE_NB = 2 + STREETS_NB + PLAYERS_NB; // Words of a signature
 
-constexpr uint64_t COMBO_EOF = ~uint64_t(0); // (COMBO_EOF & allMask) is always true
+constexpr uint16_t NO_COMBO = 0xFFFF;
 
 // Bitboards representing ranks/rows
 constexpr uint64_t Rank1BB = 0xFFFFULL << (16 * 0);
@@ -28,6 +42,15 @@ constexpr uint64_t Rank4BB = 0xFFFFULL << (16 * 3);
 
 constexpr uint64_t RanksBB[] = { Rank1BB, Rank2BB, Rank3BB, Rank4BB };
 
+// Map each row/suit r of a card bitboard to row p[r]
+inline uint64_t permute_suits(uint64_t b, const uint8_t p[])
+{
+    return  ((b >>  0) & 0xFFFF) << (16 * p[0])
+          | ((b >> 16) & 0xFFFF) << (16 * p[1])
+          | ((b >> 32) & 0xFFFF) << (16 * p[2])
+          | ((b >> 48) & 0xFFFF) << (16 * p[3]);
+}
+
 // Bitboard representing the area of the 'score' reserved for flags
 constexpr uint64_t Last3 = 0xE000;
 constexpr uint64_t FlagsArea = Last3 | (Last3 << 16) | (Last3 << 32) | (Last3 << 48);
@@ -47,6 +70,14 @@ constexpr uint32_t SuitInit  =   3 | (3 << 4) | (3 << 8) | (3 << 12);
 constexpr uint32_t SuitAdd[] = { 1 , (1 << 4) , (1 << 8) , (1 << 12) };
 constexpr uint32_t IsFlush   =   8 | (8 << 4) | (8 << 8) | (8 << 12);
 
+// Board textures: the combinations that the common cards still allow. With a
+// plain board nobody can make a flush or a straight, so scoring skips them.
+enum Texture : unsigned { TX_PLAIN = 0, TX_FLUSH = 1, TX_STRAIGHT = 2, TX_ANY = 3 };
+
+// Evaluators of the hands, that give the same scores: the bitboard one of
+// Hand::do_score() and the one out of lookup tables, see lut.cpp.
+enum Evaluator : unsigned { EV_BITBOARD, EV_LUT };
+
 struct Hand {
 
     uint64_t score;
@@ -76,6 +107,8 @@ struct Hand {
 
     void merge(const Hand& holes)
     {
+        STATS(Perf.merges++);
+
         if ((score & holes.score) == 0) { // Common case
             score |= holes.score;
             cards |= holes.cards;
@@ -83,14 +116,16 @@ struct Hand {
             return;
         }
         // We are unlucky: add one by one
+        STATS(Perf.slowMerges++);
         uint64_t v = holes.cards;
         while (v)
             add(Card(pop_lsb(&v)), 0);
     }
 
+    template<unsigned T = TX_ANY>
     void do_score()
     {
-        if (suits & IsFlush) {
+        if ((T & TX_FLUSH) && (suits & IsFlush)) {
             unsigned r = lsb(suits & IsFlush) / 4;
             score = FlushBB | ((cards & RanksBB[r]) >> (16 * r));
         }
@@ -101,7 +136,7 @@ struct Hand {
         v &= v >> 1;
         v &= v >> 1;
         v &= v >> 2;
-        if (v) {
+        if ((T & TX_STRAIGHT) && v) {
             auto f = (score & FlushBB) ? StraightFlushBB : StraightBB;
             v = 1ULL << msb(v); // Could be more than 1 in case of straight > 5
             score = f | (v << 3) | (v << 2); // At least 2 bits needed by ScoreMask
@@ -124,39 +159,196 @@ struct Hand {
     }
 };
 
+// Categories of the final hands, in increasing order of value
+enum Category : unsigned {
+    HIGH_CARD, PAIR, TWO_PAIR, SET, STRAIGHT, FLUSH, FULL_HOUSE, QUADS,
+    STRAIGHT_FLUSH, CATEGORIES_NB
+};
+
+// Category of a score computed by Hand::do_score(). Flags are checked before
+// the ranks, as they lie in the ranks' flags areas.
+inline Category category(uint64_t score)
+{
+    return  (score & StraightFlushBB) ? STRAIGHT_FLUSH
+          : (score & Rank4BB & ~FlagsArea) ? QUADS
+          : (score & FullHouseBB) ? FULL_HOUSE
+          : (score & FlushBB) ? FLUSH
+          : (score & StraightBB) ? STRAIGHT
+          : (score & Rank3BB & ~FlagsArea) ? SET
+          : (score & DoublePairBB) ? TWO_PAIR
+          : (score & Rank2BB & ~FlagsArea) ? PAIR : HIGH_CARD;
+}
+
+/// Statistics collected along the results, if requested: the categories of
+/// the final hands of each player and, in turn spots, for each river card the
+/// games where it gives the pot to a player that is behind on the turn.
+struct HandStats {
+    uint64_t categories[PLAYERS_NB][CATEGORIES_NB];
+    uint64_t riverGames[64], flips[64];
+    uint64_t outs[PLAYERS_NB][64];
+
+    void add(const HandStats& s);
+};
+
+/// A range of hole cards, each combo stored once. A random index of 'bits' bits
+/// picks the combo through pick[], where NO_COMBO entries are rejected. Bit i
+/// of symmetries is set if the range is closed under the SuitPerms[i].
+struct Range {
+    std::string token; // As given, like "[AK,88+,76s+]"
+    std::vector<Hand> combos;
+    std::vector<uint16_t> pick;
+    unsigned bits;
+    uint32_t symmetries;
+};
+
+/// Ranges are immutable once parsed, so spots share them
+typedef std::shared_ptr<const Range> RangePtr;
+
+extern const uint8_t SuitPerms[24][4];
+extern RangePtr get_range(const std::string& token);
+
+extern void score_hands(Hand hands[], size_t n, Texture t = TX_ANY,
+                        Evaluator e = EV_BITBOARD);
+extern void score_hands(uint64_t score[], const uint64_t cards[],
+                        const uint32_t suits[], size_t n, Texture t = TX_ANY,
+                        Evaluator e = EV_BITBOARD);
+extern void score_lut(uint64_t score[], const uint64_t cards[],
+                      const uint32_t suits[], size_t n);
+extern size_t lut_check(size_t hands);
+
 class Spot {
 
-    Hand combos[PLAYERS_NB][MAX_RANGE];
+    RangePtr ranges[PLAYERS_NB];
     int combosId[PLAYERS_NB + 1];
     int missingHolesId[PLAYERS_NB * HOLE_NB + 1];
     Hand givenHoles[PLAYERS_NB];
     Hand givenCommon;
 
-    PRNG* prng;
     unsigned numPlayers;
     unsigned missingCommons;
     uint32_t enumMask;
     uint32_t rangeMask;
     uint64_t givenAllMask;
+    uint64_t streetCards[STREETS_NB - 1]; // Turn and river in street mode
+    unsigned numStreets;
+    Texture texture;
+    Evaluator evaluator;
+    uint8_t suitPerms[24][4]; // Suit permutations that leave the spot unchanged
+    unsigned permsNum;
+    uint8_t deck[DECK_NB]; // Cards not given, for the deck dealer
+    unsigned deckSize;
+    unsigned deckDeals; // Cards dealt from the deck in each game
+    bool deckDealer;
     bool ready;
 
-    void enumerate(std::vector<uint64_t>& enumBuf, unsigned missing,
+    struct EnumState;
+    struct ScoreCache;
+    friend struct MicroBench;
+
+public:
+    /// What changes while a thread plays the spot, the Spot itself is never
+    /// modified once built, so that all the threads share it instead of each
+    /// one copying it.
+    struct State {
+        PRNG* prng;
+        HandStats* stats;
+        ScoreCache* scoreCache; // Only in full enumeration
+        Card lastCommon;        // Last common card dealt
+    };
+
+private:
+    // A run_batch() kernel, with the number of players P and of missing common
+    // cards C fixed at compile time where they are not -1, see init_kernel().
+    typedef void (Spot::*BatchKernel)(State&, size_t, Result[], const unsigned[]) const;
+
+    BatchKernel batchKernel; // The kernel for the shape of the spot
+
+    template<typename Source>
+    uint64_t pick_ranges(Source& src, Hand picked[]) const;
+    template<int P = -1, int C = -1, typename Source>
+    void deal(State& st, Source& src, Hand hands[]) const;
+    template<int P = -1, int C = -1>
+    void deal_deck(State& st, uint8_t live[], Hand hands[]) const;
+    template<int P, int C>
+    void batch_kernel(State& st, size_t n, Result results[], const unsigned weights[]) const;
+    template<int P, typename Dealer>
+    void play_batch(State& st, Dealer& dealer, size_t n, Result results[],
+                    const unsigned weights[]) const;
+    template<int P>
+    BatchKernel kernel_of() const;
+    void init_kernel();
+    void enumerate(EnumState& st, unsigned missing,
                    uint64_t rnd64[], int shifts[], int limit,
-                   size_t idx, size_t threadsNum);
-    bool parse_range(const std::string& token, int player);
+                   size_t idx, size_t threadsNum) const;
+    void play_block(EnumState& st) const;
+    void collect_stats(HandStats& stats, size_t n, uint64_t score[][MAX_BATCH],
+                       uint64_t cards[][MAX_BATCH], const Card last[],
+                       const unsigned weight[]) const;
+    void run_streets(size_t n, uint64_t cards[][MAX_BATCH], const uint64_t boards[],
+                     const Card last[], const unsigned weight[], bool exact,
+                     Result results[]) const;
+    void score_known(ScoreCache& cache, uint64_t score[], const uint64_t cards[],
+                     const uint32_t suits[], size_t n) const;
+    bool canonical(EnumState& st, uint64_t group) const;
+    void init(int playersNum, const uint64_t holes[], const RangePtr holeRanges[],
+              uint64_t commons, uint64_t turn, uint64_t river);
+    void init_suit_perms();
+    void init_texture();
 
 public:
     Spot() = default;
-    explicit Spot(int playersNum, const std::string& pos);
-    void run(Result results[]);
-    size_t set_enumerate(std::vector<uint64_t>&, size_t, size_t);
+    explicit Spot(int playersNum, const std::string& pos, bool streets = false);
+    Spot(int playersNum, const uint64_t holes[], const RangePtr holeRanges[],
+         uint64_t commons, uint64_t turn = 0, uint64_t river = 0) {
+        init(playersNum, holes, holeRanges, commons, turn, river);
+    }
+    void run_batch(State& st, size_t n, Result results[],
+                   const unsigned weights[] = nullptr) const {
+        (this->*batchKernel)(st, n, results, weights);
+    }
+    size_t run_enumerate(State& st, std::vector<uint64_t>&, size_t, size_t,
+                         Result results[]) const;
 
     bool valid() const { return ready; }
+    bool can_enumerate() const;
+    void signature(uint64_t sig[SIGNATURE_NB]) const;
+    bool preflop() const { return missingCommons == 5 && combosId[0] == -1; }
     uint64_t eval() const { return givenCommon.score; }
+    uint64_t hole_cards(size_t p) const { return givenHoles[p].cards; }
+    size_t range_size(size_t p) const { return ranges[p] ? ranges[p]->combos.size() : 0; }
+    const Range* range(size_t p) const { return ranges[p].get(); }
+    uint64_t common_cards() const { return givenCommon.cards; }
     size_t players() const { return numPlayers; }
-    void set_prng(PRNG* p) { prng = p; }
+    size_t streets() const { return numStreets; }
+    void set_deck_dealer(bool b) { deckDealer = b; }
+    void set_evaluator(Evaluator e) { evaluator = e; }
+};
+
+// Stores parsed args out of the position string
+struct Args {
+    Result results[MAX_RESULTS];
+    std::string pos;
+    size_t gamesNum, threadsNum;
+    double precision;
+    int64_t msLimit;
+    size_t shard, shardsNum; // Shard of the run to play, see run()
+    int players;
+    bool enumerate, streets, handStats, deck, lut;
+    bool sharded; // Given -k, also as 1/1
 };
 
-extern void run(const Spot& s, size_t games, size_t threads, bool enumerate, Result results[]);
+extern bool parse_args(std::istream& is, Args& parsed);
+extern size_t run(const Spot& s, size_t games, size_t threads, bool enumerate,
+                  Result results[], double precision = 0, int64_t msLimit = 0,
+                  HandStats* stats = nullptr, size_t shard = 0, size_t shardsNum = 1);
+extern void pretty_stats(const HandStats& s, size_t players);
+extern void pretty_counters();
+extern void set_pinning(bool pin);
+extern void set_max_threads(size_t n);
+extern void pretty_numa();
+extern void run(const Spot spots[], Args args[], size_t n);
+extern size_t run_many(const std::vector<Spot>& spots, size_t games, size_t threads,
+                       bool enumerate, Result results[]);
+extern size_t run_tasks(size_t threads, const std::function<size_t(size_t)>& task);
 
 #endif // #ifndef POKER_H_INCLUDED
@@ -0,0 +1,76 @@
+#ifndef POKER_API_H_INCLUDED
+#define POKER_API_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C API of libpoker, to run spots in-process instead of through the
+ * command-line tool. All the functions are thread safe: a spot is immutable
+ * once created, so many threads can run the same one at once, and runs share
+ * the engine's thread pool. Nothing is written to stdout or stderr.
+ *
+ *   poker_spot* s = poker_spot_create("-p 3 AcKd [QQ+,AK] - 2c 3d 4h");
+ *   poker_result r[9];
+ *   double eq[9];
+ *
+ *   if (s && poker_run(s, 1000000, 4, 0, r, 9) > 0)
+ *       poker_equities(r, poker_spot_players(s), eq);
+ *
+ *   poker_spot_destroy(s);
+ */
+
+#if defined(__GNUC__)
+#define POKER_API __attribute__((visibility("default")))
+#else
+#define POKER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Split pots are counted in units of 1/POKER_TIE_UNIT of a pot */
+#define POKER_TIE_UNIT 2520
+
+/* Errors returned by poker_run() */
+#define POKER_ERR_BUFFER    (-1) /* Results buffer too small */
+#define POKER_ERR_ENUMERATE (-2) /* Missing too many cards to enumerate */
+
+typedef struct poker_spot poker_spot;
+
+/* Outcome of a player: the pots won, and the shares of the split ones */
+typedef struct {
+    uint64_t won;
+    uint64_t tied;
+} poker_result;
+
+/* Create a spot out of the same string of the go command, like
+   "-g 1M -t 4 AcKd 7h7s - 2c 3d 4h". Options set the defaults of poker_run().
+   Return NULL if the spot or the value of an option is not valid. */
+POKER_API poker_spot* poker_spot_create(const char* spot);
+
+POKER_API void poker_spot_destroy(poker_spot* s);
+
+/* Number of players, and of streets: 3 in street mode (-s), otherwise 1 */
+POKER_API int poker_spot_players(const poker_spot* s);
+POKER_API int poker_spot_streets(const poker_spot* s);
+
+/* Run the spot and write the results, players * streets of them, one street
+   after the other, to results[], that has room for size entries. Run games
+   games, or the spot's ones if 0, on threads threads, or the spot's ones if
+   0. If enumerate is not 0, or the spot has -e, the spot is fully enumerated.
+   Return the number of games played (combinations if enumerated), or one of
+   the POKER_ERR_* errors. */
+POKER_API int64_t poker_run(const poker_spot* s, uint64_t games, unsigned threads,
+                            int enumerate, poker_result results[], size_t size);
+
+/* Write the equity of each of the players out of their results, in [0, 1] */
+POKER_API void poker_equities(const poker_result results[], int players,
+                              double equities[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef POKER_API_H_INCLUDED */
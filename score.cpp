@@ -0,0 +1,295 @@
+#include <cstdint>
+
+#if defined(USE_AVX512) || defined(USE_AVX2)
+#include <immintrin.h>
+#endif
+
+#include "poker.h"
+
+namespace {
+
+#if defined(USE_AVX512) || defined(USE_AVX2)
+
+// A thin layer of wrappers around the intrinsics, so that the scoring code
+// below is written once and compiled for both 4 (AVX2) and 8 (AVX-512) lanes.
+// Each lane holds a 64 bit score, cards or suits value of a different hand.
+
+#if defined(USE_AVX512)
+
+typedef __m512i Vec;
+typedef __mmask8 Mask;
+
+constexpr size_t Lanes = 8;
+
+inline Vec set1(uint64_t v) { return _mm512_set1_epi64(int64_t(v)); }
+inline Vec and_(Vec a, Vec b) { return _mm512_and_si512(a, b); }
+inline Vec or_(Vec a, Vec b) { return _mm512_or_si512(a, b); }
+inline Vec xor_(Vec a, Vec b) { return _mm512_xor_si512(a, b); }
+inline Vec andnot(Vec a, Vec b) { return _mm512_andnot_si512(a, b); } // ~a & b
+inline Vec add(Vec a, Vec b) { return _mm512_add_epi64(a, b); }
+inline Vec sub(Vec a, Vec b) { return _mm512_sub_epi64(a, b); }
+template<int N> Vec srli(Vec v) { return _mm512_srli_epi64(v, N); }
+template<int N> Vec slli(Vec v) { return _mm512_slli_epi64(v, N); }
+inline Vec sllv(Vec v, Vec n) { return _mm512_sllv_epi64(v, n); }
+inline Vec srlv(Vec v, Vec n) { return _mm512_srlv_epi64(v, n); }
+
+inline Mask nonzero(Vec v) { return _mm512_test_epi64_mask(v, v); }
+inline Mask greater(Vec a, Vec b) { return _mm512_cmpgt_epi64_mask(a, b); }
+inline Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_epi64(m, a, b); } // m ? b : a
+
+// Index of the most significant bit, undefined for zero lanes like msb()
+inline Vec msb(Vec v) { return sub(set1(63), _mm512_lzcnt_epi64(v)); }
+
+inline Vec gather(Mask m, const uint64_t* base, Vec idx) {
+    return _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), m, idx, base, 8);
+}
+
+inline Mask tail_mask(size_t n) { return Mask((1U << n) - 1); }
+
+inline Vec load64(const uint64_t* p) { return _mm512_loadu_si512(p); }
+inline Vec load32(const uint32_t* p) { return _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)p)); }
+inline void store64(uint64_t* p, Vec v) { _mm512_storeu_si512(p, v); }
+
+inline Vec load64(Mask m, const uint64_t* p) { return _mm512_maskz_loadu_epi64(m, p); }
+inline Vec load32(Mask m, const uint32_t* p) {
+    return _mm512_cvtepu32_epi64(_mm256_maskz_loadu_epi32(m, p));
+}
+inline void store64(Mask m, uint64_t* p, Vec v) { _mm512_mask_storeu_epi64(p, m, v); }
+
+#else // USE_AVX2
+
+typedef __m256i Vec;
+typedef __m256i Mask; // Lanes are all ones or all zeros
+
+constexpr size_t Lanes = 4;
+
+inline Vec set1(uint64_t v) { return _mm256_set1_epi64x(int64_t(v)); }
+inline Vec and_(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+inline Vec or_(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+inline Vec xor_(Vec a, Vec b) { return _mm256_xor_si256(a, b); }
+inline Vec andnot(Vec a, Vec b) { return _mm256_andnot_si256(a, b); } // ~a & b
+inline Vec add(Vec a, Vec b) { return _mm256_add_epi64(a, b); }
+inline Vec sub(Vec a, Vec b) { return _mm256_sub_epi64(a, b); }
+template<int N> Vec srli(Vec v) { return _mm256_srli_epi64(v, N); }
+template<int N> Vec slli(Vec v) { return _mm256_slli_epi64(v, N); }
+inline Vec sllv(Vec v, Vec n) { return _mm256_sllv_epi64(v, n); }
+inline Vec srlv(Vec v, Vec n) { return _mm256_srlv_epi64(v, n); }
+
+inline Mask nonzero(Vec v) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi64(v, _mm256_setzero_si256()), set1(~0ULL));
+}
+inline Mask greater(Vec a, Vec b) { return _mm256_cmpgt_epi64(a, b); }
+inline Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_epi8(a, b, m); } // m ? b : a
+
+// There is no lzcnt for 64 bit lanes in AVX2, so convert each 32 bit half to
+// float and read the exponent. Conversion rounds to 24 bits of mantissa, but
+// rounding can't carry into the exponent because the scores we feed here have
+// the flags area (bits 13-15 of each rank) always empty. A zero half gives -127
+// so that max() picks the right half. Undefined for zero lanes like msb().
+inline Vec msb(Vec v) {
+    Vec e = _mm256_castps_si256(_mm256_cvtepi32_ps(v));
+    e = _mm256_sub_epi32(_mm256_srli_epi32(e, 23), _mm256_setr_epi32(127, 95, 127, 95, 127, 95, 127, 95));
+    e = _mm256_max_epi32(e, _mm256_shuffle_epi32(e, _MM_SHUFFLE(2, 3, 0, 1)));
+    return and_(e, set1(0xFFFFFFFF));
+}
+
+// Population count of the first rank (13 bits) with the usual nibble lookup
+inline Vec popcount16(Vec v) {
+    const Vec lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const Vec low = _mm256_set1_epi8(0x0F);
+
+    Vec lo = _mm256_shuffle_epi8(lut, and_(v, low));
+    Vec hi = _mm256_shuffle_epi8(lut, and_(_mm256_srli_epi16(v, 4), low));
+    v = _mm256_add_epi8(lo, hi);
+    return and_(add(v, srli<8>(v)), set1(0x1F));
+}
+
+inline Vec gather(Mask m, const uint64_t* base, Vec idx) {
+    return _mm256_mask_i64gather_epi64(_mm256_setzero_si256(),
+                                       (const long long*)base, idx, m, 8);
+}
+
+inline Mask tail_mask(size_t n) {
+    return _mm256_cmpgt_epi64(set1(n), _mm256_setr_epi64x(0, 1, 2, 3));
+}
+
+inline Vec load64(const uint64_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline Vec load32(const uint32_t* p) { return _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)p)); }
+inline void store64(uint64_t* p, Vec v) { _mm256_storeu_si256((__m256i*)p, v); }
+
+inline Vec load64(Mask m, const uint64_t* p) {
+    return _mm256_maskload_epi64((const long long*)p, m);
+}
+inline Vec load32(Mask m, const uint32_t* p) {
+    // Narrow the 64 bit lane mask to 32 bit lanes picking the low halves
+    __m128i m32 = _mm256_castsi256_si128(
+        _mm256_permutevar8x32_epi32(m, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+    return _mm256_cvtepu32_epi64(_mm_maskload_epi32((const int*)p, m32));
+}
+inline void store64(Mask m, uint64_t* p, Vec v) {
+    _mm256_maskstore_epi64((long long*)p, m, v);
+}
+
+#endif
+
+#if defined(USE_AVX512)
+
+// Population count of the first rank (13 bits), plain SWAR with shifts and adds
+inline Vec popcount16(Vec v) {
+    v = sub(v, and_(srli<1>(v), set1(0x5555)));
+    v = add(and_(v, set1(0x3333)), and_(srli<2>(v), set1(0x3333)));
+    v = and_(add(v, srli<4>(v)), set1(0x0F0F));
+    return and_(add(v, srli<8>(v)), set1(0x1F));
+}
+
+#endif
+
+/// Same as Hand::do_score() but on a vector of hands, in lock-step without any
+/// branch: every conditional step is computed on all the lanes and then merged
+/// with a select according to the lane's condition. Inactive lanes (beyond the
+/// tail) are masked only where it matters, i.e. in the ScoreMask gather. Steps
+/// for the combinations that texture T rules out are compiled away.
+template<unsigned T>
+Vec score_lanes(Mask active, Vec score, Vec cards, Vec suits)
+{
+    Vec v;
+
+    if (T & TX_FLUSH) {
+        // Flush detector bit is at 4 * suit + 3, shift the cards by 16 * suit to get
+        // the suit's ranks. Shift of lanes without a flush is junk, but discarded.
+        Vec f = and_(suits, set1(IsFlush));
+        Vec flush = and_(srlv(cards, sub(slli<2>(msb(f)), set1(12))), set1(Rank1BB));
+        score = select(nonzero(f), score, or_(flush, set1(FlushBB)));
+    }
+
+    if (T & TX_STRAIGHT) {
+        // Check for a straight
+        v = and_(score, set1(Rank1BB));
+        v = or_(slli<1>(v), srli<12>(v)); // Duplicate an ace into first position
+        v = and_(v, srli<1>(v));
+        v = and_(v, srli<1>(v));
+        v = and_(v, srli<2>(v));
+
+        // Isolate the msb of v, it fits in 16 bits so a short smear is enough
+        Vec t = or_(v, srli<1>(v));
+        t = or_(t, srli<2>(t));
+        t = or_(t, srli<4>(t));
+        t = or_(t, srli<8>(t));
+        t = xor_(t, srli<1>(t));
+
+        Vec f = (T & TX_FLUSH)
+              ? select(nonzero(and_(score, set1(FlushBB))), set1(StraightBB), set1(StraightFlushBB))
+              : set1(StraightBB);
+        score = select(nonzero(v), score, or_(f, or_(slli<3>(t), slli<2>(t))));
+    }
+
+    // Drop all bits below the highest ones so that when calling 2 times
+    // msb() we get bits on different files/columns.
+    v = andnot(set1(FlagsArea), xor_(score, srli<16>(score)));
+
+    // Mask out the score and get the final one
+    Vec idx1 = msb(v);
+    v = xor_(v, sllv(set1(1), idx1));
+    Vec mask = gather(active, ScoreMask.masks, add(slli<6>(idx1), msb(v)));
+    score = and_(or_(score, set1(FullHouseBB | DoublePairBB)), mask);
+
+    // Drop the lowest cards so that only 5 remains. Out of 7 cards at most 2
+    // have to be dropped, so 2 masked steps replace the scalar while loop.
+    Vec cnt = and_(srli<13>(mask), set1(0x7));
+    Vec p = popcount16(and_(score, set1(Rank1BB)));
+
+    for (int i = 0; i < 2; ++i) {
+        Mask drop = greater(p, cnt);
+        score = select(drop, score, and_(score, sub(score, set1(1))));
+        p = select(drop, p, sub(p, set1(1)));
+    }
+    return score;
+}
+
+#endif
+
+// Score n hands with the scoring code specialized for the board texture T
+template<unsigned T>
+void score_texture(uint64_t score[], const uint64_t cards[], const uint32_t suits[], size_t n)
+{
+#if defined(USE_AVX512) || defined(USE_AVX2)
+
+    size_t i = 0;
+
+    for ( ; i + Lanes <= n; i += Lanes) {
+        Vec s = score_lanes<T>(tail_mask(Lanes), load64(score + i), load64(cards + i), load32(suits + i));
+        store64(score + i, s);
+    }
+
+    if (i < n) {
+        Mask m = tail_mask(n - i);
+        Vec s = score_lanes<T>(m, load64(m, score + i), load64(m, cards + i), load32(m, suits + i));
+        store64(m, score + i, s);
+    }
+
+#else
+
+    for (size_t i = 0; i < n; ++i) {
+        Hand h = { score[i], cards[i], suits[i] };
+        h.do_score<T>();
+        score[i] = h.score;
+    }
+
+#endif
+}
+
+} // namespace
+
+/// score_hands() calls Hand::do_score() on a batch of hands given in structure
+/// of arrays layout. When SIMD is available hands are scored Lanes at a time,
+/// the tail in a last masked round, so that even a small batch (like the
+/// players of a single game) avoids the data-dependent branches of do_score().
+/// Only the score[] array is updated, cards[] and suits[] are read only. The
+/// hands should share a board of texture t, see Spot::init_texture(). With
+/// the lookup tables evaluator e the texture doesn't matter.
+void score_hands(uint64_t score[], const uint64_t cards[], const uint32_t suits[],
+                 size_t n, Texture t, Evaluator e)
+{
+    if (e == EV_LUT)
+        score_lut(score, cards, suits, n);
+    else
+        switch (t) {
+        case TX_PLAIN:    score_texture<TX_PLAIN>(score, cards, suits, n); break;
+        case TX_FLUSH:    score_texture<TX_FLUSH>(score, cards, suits, n); break;
+        case TX_STRAIGHT: score_texture<TX_STRAIGHT>(score, cards, suits, n); break;
+        default:          score_texture<TX_ANY>(score, cards, suits, n); break;
+        }
+
+#ifdef USE_STATS
+    // Counted on the outcome, the same for all the evaluators
+    for (size_t i = 0; i < n; ++i) {
+        Category c = category(score[i]);
+        Perf.flushes += c == FLUSH || c == STRAIGHT_FLUSH;
+        Perf.straights += c == STRAIGHT || c == STRAIGHT_FLUSH;
+    }
+    Perf.scored += n;
+#endif
+}
+
+/// Same as above, but for an array of Hand objects. The hands are transposed
+/// into a structure of arrays on the stack and scores are copied back.
+void score_hands(Hand hands[], size_t n, Texture t, Evaluator e)
+{
+    // Zero init to silence a false 'maybe uninitialized' on masked loads
+    uint64_t score[PLAYERS_NB] = {}, cards[PLAYERS_NB] = {};
+    uint32_t suits[PLAYERS_NB] = {};
+
+    assert(n <= PLAYERS_NB);
+
+    for (size_t i = 0; i < n; ++i) {
+        score[i] = hands[i].score;
+        cards[i] = hands[i].cards;
+        suits[i] = hands[i].suits;
+    }
+
+    score_hands(score, cards, suits, n, t, e);
+
+    for (size_t i = 0; i < n; ++i)
+        hands[i].score = score[i];
+}
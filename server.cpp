@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "db.h"
+#include "poker.h"
+#include "server.h"
+
+using namespace std;
+
+/// In server mode clients connect with TCP or to a Unix socket and send lines
+/// of one or more spots, separated by ';', in the same format of go, like:
+///
+///   -g 100K AcKd 7h7s ; -e -t 2 AA KK - 2c 3d 4h
+///
+/// Spots of a line run at once on the thread pool, up to maxSpots at a time,
+/// and for each one, in the same order, the server replies with a JSON line:
+///
+///   {"id":0,"games":100000,"equity":[0.446124,0.553876],"won":[44467,55251],"tied":[141.00,141.00]}
+///   {"id":1,"error":"Missing too many cards"}
+///
+/// Each connection is served by its own thread, a "quit" line closes it. To
+/// bound the resources a client can take, the server accepts up to MaxClients
+/// connections at once, drops a connection whose line grows over MaxLine bytes,
+/// and caps the -t of a spot to the server's maxSpots. The spots of all the
+/// connections share the threads of the pool, that are capped to the hardware
+/// threads, however many spots are in flight.
+///
+/// Spots run as a shard, with -k i/n, also 1/1, add the exact split pots, in
+/// units of 1/2520 of a pot, as "tiedUnits". The coordinator of cluster() sends
+/// shard i of n of the same spot to each of n servers and adds these up, so that
+/// the merged results are exactly the ones of the whole run on a single machine.
+
+namespace {
+
+constexpr int MaxClients = 64;
+constexpr size_t MaxLine = 64 * 1024;
+
+std::atomic<int> Clients; // Connections being served
+
+// A spot of a request line, with its outcome
+struct Request {
+    Args args;
+    size_t streets = 1;
+    string error;
+};
+
+// Write the games, the equities and the counters of the players' results, or
+// return false if there are no games. Ties are also written exact if units, as
+// for a shard, that is written also with no games: a shard can get no chunks of
+// a short run, and its empty results are still a valid part of the run.
+bool json_results(stringstream& ss, const Result results[], int players, bool units)
+{
+    size_t games = 0;
+    for (int p = 0; p < players; ++p)
+        games += size_t(KTie) * results[p].first + results[p].second;
+    games /= KTie;
+
+    if (!games && !units)
+        return false;
+
+    ss << "\"games\":" << games << std::fixed << std::setprecision(6) << ",\"equity\":[";
+    for (int p = 0; p < players; ++p)
+        ss << (p ? "," : "")
+           << (games ? (double(KTie) * results[p].first + results[p].second) / KTie / games : 0);
+
+    ss << "],\"won\":[";
+    for (int p = 0; p < players; ++p)
+        ss << (p ? "," : "") << results[p].first;
+
+    ss << "],\"tied\":[" << std::setprecision(2);
+    for (int p = 0; p < players; ++p)
+        ss << (p ? "," : "") << double(results[p].second) / KTie;
+
+    if (units) {
+        ss << "],\"tiedUnits\":[";
+        for (int p = 0; p < players; ++p)
+            ss << (p ? "," : "") << results[p].second;
+    }
+
+    ss << "]";
+    return true;
+}
+
+// Write s as a JSON string, escaping the quotes, the backslashes and the bytes
+// out of printable ASCII, as errors echo the client's own spot, that may not
+// even be valid UTF-8.
+void json_string(stringstream& ss, const string& s)
+{
+    const char* Hex = "0123456789abcdef";
+
+    ss << "\"";
+    for (unsigned char c : s)
+        if (c == '"' || c == '\\')
+            ss << '\\' << c;
+        else if (c < 0x20 || c > 0x7e)
+            ss << "\\u00" << Hex[c >> 4] << Hex[c & 15];
+        else
+            ss << c;
+    ss << "\"";
+}
+
+// Reply to a single spot as a JSON object on a single line. In street mode the
+// results are the flop ones, followed by the "turn" and "river" objects.
+string json_reply(size_t id, const Request& r)
+{
+    const char* Streets[] = { "flop", "turn", "river" };
+    const Args& a = r.args;
+    stringstream ss;
+
+    ss << "{\"id\":" << id;
+
+    if (r.error.size()) {
+        ss << ",\"error\":";
+        json_string(ss, r.error);
+        ss << "}\n";
+        return ss.str();
+    }
+
+    ss << ",";
+    if (!json_results(ss, a.results, a.players, a.sharded)) {
+        ss << "\"error\":\"No games played\"}\n";
+        return ss.str();
+    }
+
+    for (size_t i = 1; i < r.streets; ++i) {
+        ss << ",\"" << Streets[i] << "\":{";
+        if (!json_results(ss, a.results + i * a.players, a.players, a.sharded))
+            ss << "\"games\":0";
+        ss << "}";
+    }
+
+    ss << "}\n";
+    return ss.str();
+}
+
+// Run the spots of a request line and return the replies
+string process(const string& line, size_t maxSpots)
+{
+    vector<Request> requests;
+    stringstream ls(line);
+    string token, replies;
+
+    while (getline(ls, token, ';')) {
+        istringstream is(token);
+        Request r;
+
+        if (token.find_first_not_of(" \t\r") == string::npos)
+            continue;
+
+        if (!parse_args(is, r.args))
+            r.error = "Invalid option value";
+        r.args.threadsNum = std::min(r.args.threadsNum, maxSpots);
+        std::fill(r.args.results, r.args.results + MAX_RESULTS, Result());
+        requests.push_back(r);
+    }
+
+    for (size_t i = 0; i < requests.size(); i += maxSpots) {
+        size_t end = std::min(i + maxSpots, requests.size());
+        vector<Spot> spots;
+        vector<Args> args;
+        vector<size_t> ids;
+
+        for (size_t id = i; id < end; ++id) {
+            Request& r = requests[id];
+            if (r.error.size())
+                continue;
+
+            Spot s(r.args.players, r.args.pos, r.args.streets);
+            s.set_deck_dealer(r.args.deck);
+            s.set_evaluator(r.args.lut ? EV_LUT : EV_BITBOARD);
+            r.streets = s.valid() ? s.streets() : 1;
+
+            if (!s.valid())
+                r.error = "Error in: " + r.args.pos;
+
+            else if (r.args.shard >= r.args.shardsNum)
+                r.error = "Invalid shard";
+
+            else if (r.args.enumerate && !s.can_enumerate())
+                r.error = "Missing too many cards";
+
+            else if (r.args.shardsNum > 1 || !db_probe(s, r.args.enumerate, r.args.results)) {
+                spots.push_back(s);
+                args.push_back(r.args);
+                ids.push_back(id);
+            }
+        }
+
+        run(spots.data(), args.data(), spots.size());
+
+        for (size_t k = 0; k < ids.size(); ++k)
+            requests[ids[k]].args = args[k];
+
+        for (size_t id = i; id < end; ++id)
+            replies += json_reply(id, requests[id]);
+    }
+    return replies;
+}
+
+#ifndef _WIN32
+
+// Listen on a Unix socket if addr is a path, otherwise on TCP at [host:]port,
+// with host defaulting to localhost. Return the socket or -1 on failure.
+int listen_on(const string& addr)
+{
+    int fd;
+
+    if (addr.find('/') != string::npos) {
+        sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+
+        if (addr.size() >= sizeof(sa.sun_path))
+            return -1;
+
+        strcpy(sa.sun_path, addr.c_str());
+        unlink(addr.c_str()); // Remove the stale socket of a previous run
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || bind(fd, (sockaddr*)&sa, sizeof(sa)) == -1)
+            return -1;
+    } else {
+        size_t colon = addr.rfind(':');
+        string host = colon == string::npos ? "127.0.0.1" : addr.substr(0, colon);
+        int port = atoi(addr.substr(colon + 1).c_str()); // npos + 1 == 0
+        int yes = 1;
+
+        sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(uint16_t(port));
+
+        if (port <= 0 || inet_pton(AF_INET, host.c_str(), &sa.sin_addr) != 1)
+            return -1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (   fd == -1
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1
+            || bind(fd, (sockaddr*)&sa, sizeof(sa)) == -1)
+            return -1;
+    }
+    return listen(fd, 64) == -1 ? -1 : fd;
+}
+
+// Connect to a server listening on addr, in the same format of listen_on().
+// Return the socket or -1 on failure.
+int connect_to(const string& addr)
+{
+    int fd;
+
+    if (addr.find('/') != string::npos) {
+        sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+
+        if (addr.size() >= sizeof(sa.sun_path))
+            return -1;
+
+        strcpy(sa.sun_path, addr.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (sockaddr*)&sa, sizeof(sa)) == -1)
+            return fd != -1 ? close(fd), -1 : -1;
+    } else {
+        size_t colon = addr.rfind(':');
+        string host = colon == string::npos ? "127.0.0.1" : addr.substr(0, colon);
+        int port = atoi(addr.substr(colon + 1).c_str()); // npos + 1 == 0
+
+        sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(uint16_t(port));
+
+        if (port <= 0 || inet_pton(AF_INET, host.c_str(), &sa.sin_addr) != 1)
+            return -1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (sockaddr*)&sa, sizeof(sa)) == -1)
+            return fd != -1 ? close(fd), -1 : -1;
+    }
+    return fd;
+}
+
+bool send_all(int fd, const string& data)
+{
+    for (size_t sent = 0; sent < data.size(); ) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0 && errno != EINTR)
+            return false;
+        sent += n > 0 ? size_t(n) : 0;
+    }
+    return true;
+}
+
+// Read request lines from a client until it disconnects, sends "quit" or a
+// line longer than MaxLine.
+void serve_client(int fd, size_t maxSpots)
+{
+    string buf;
+    char chunk[4096];
+    ssize_t n;
+    bool alive = true;
+
+    while (   alive && buf.size() <= MaxLine
+           && ((n = recv(fd, chunk, sizeof(chunk), 0)) > 0 || (n == -1 && errno == EINTR))) {
+        buf.append(chunk, n > 0 ? size_t(n) : 0);
+
+        for (size_t eol; alive && (eol = buf.find('\n')) != string::npos; ) {
+            string line = buf.substr(0, eol);
+            buf.erase(0, eol + 1);
+
+            if (line.size() && line.back() == '\r')
+                line.pop_back();
+
+            alive =   line.size() <= MaxLine && line != "quit"
+                   && send_all(fd, process(line, maxSpots));
+        }
+    }
+    close(fd);
+    Clients--;
+}
+
+// Add to results the integers of the JSON array 'key' in the reply, from pos
+// on. Return false if the array is missing or too short.
+bool add_array(const string& reply, size_t pos, const string& key, uint64_t Result::* field,
+               Result results[], size_t players)
+{
+    pos = reply.find("\"" + key + "\":[", pos);
+    if (pos == string::npos)
+        return false;
+
+    istringstream is(reply.substr(pos + key.size() + 4));
+    uint64_t v;
+    char sep;
+
+    for (size_t p = 0; p < players; ++p) {
+        if (!(is >> v))
+            return false;
+        results[p].*field += v;
+        is >> sep;
+    }
+    return true;
+}
+
+// Run shard 'shard' of n of the spot on the server at addr, and on success
+// add its results, players * streets of them, one street after the other.
+// Otherwise set error.
+void run_shard(const string& addr, const string& spot, size_t shard, size_t n,
+               size_t players, size_t streets, Result results[], string& error)
+{
+    const char* Streets[] = { "", "\"turn\":{", "\"river\":{" };
+
+    string reply, line = "-k " + to_string(shard + 1) + "/" + to_string(n) + " " + spot + "\n";
+    char chunk[4096];
+    ssize_t len = 0;
+    int fd = connect_to(addr);
+
+    if (fd == -1) {
+        error = "Cannot connect to: " + addr;
+        return;
+    }
+
+    if (send_all(fd, line))
+        while (   reply.find('\n') == string::npos
+               && ((len = recv(fd, chunk, sizeof(chunk), 0)) > 0 || (len == -1 && errno == EINTR)))
+            reply.append(chunk, len > 0 ? size_t(len) : 0);
+
+    send_all(fd, "quit\n");
+    close(fd);
+
+    size_t pos = reply.find("\"error\":\"");
+    if (reply.find('\n') == string::npos || pos != string::npos) {
+        error = addr + ": " + (pos == string::npos ? "No reply"
+                               : reply.substr(pos + 9, reply.find('"', pos + 9) - pos - 9));
+        return;
+    }
+
+    // A shard has the arrays of each street also with no games, then of zeros
+    for (size_t s = 0; s < streets; ++s) {
+        size_t start = s ? reply.find(Streets[s]) : 0;
+        size_t end = s + 1 < streets ? reply.find(Streets[s + 1]) : string::npos;
+
+        if (start == string::npos) {
+            error = addr + ": Invalid reply";
+            return;
+        }
+
+        string part = reply.substr(start, end == string::npos ? end : end - start);
+
+        if (   !add_array(part, 0, "won", &Result::first, results + s * players, players)
+            || !add_array(part, 0, "tiedUnits", &Result::second, results + s * players, players)) {
+            error = addr + ": Invalid reply";
+            return;
+        }
+    }
+}
+
+#endif
+
+} // namespace
+
+/// Start the server on addr and serve clients until a failure. Each connection
+/// runs up to maxSpots spots at once, of up to maxSpots threads each.
+void server(const string& addr, size_t maxSpots)
+{
+#ifdef _WIN32
+    (void)addr, (void)maxSpots;
+    cerr << "Server mode is not supported on Windows" << endl;
+#else
+    signal(SIGPIPE, SIG_IGN); // A client disconnecting should not kill us
+    set_max_threads(std::max(std::thread::hardware_concurrency(), 1U));
+
+    int fd = listen_on(addr);
+    if (fd == -1) {
+        cerr << "Cannot listen on: " << addr << endl;
+        return;
+    }
+
+    cout << "Listening on " << addr << endl;
+
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+
+        if (client == -1 && errno == EINTR)
+            continue;
+
+        if (client == -1) {
+            cerr << "Error accepting a connection: " << strerror(errno) << endl;
+            break;
+        }
+        if (Clients >= MaxClients) {
+            send_all(client, "{\"error\":\"Too many connections\"}\n");
+            close(client);
+            continue;
+        }
+        Clients++;
+        std::thread(serve_client, client, std::max(maxSpots, size_t(1))).detach();
+    }
+    close(fd);
+#endif
+}
+
+/// Run the spot, a line as given to go, split among the servers at addrs, so that
+/// the server i plays shard i of the run, all at once, and add up their results,
+/// n of them, to results. Each server plays the games of its shard with the
+/// threads of the spot's -t. Results are players * streets, as the ones of
+/// run(). Return false if any of the shards failed.
+bool cluster(const vector<string>& addrs, const string& spot, size_t players,
+             size_t streets, Result results[])
+{
+#ifdef _WIN32
+    (void)addrs, (void)spot, (void)players, (void)streets, (void)results;
+    cerr << "Cluster mode is not supported on Windows" << endl;
+    return false;
+#else
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<vector<Result>> shards(addrs.size(), vector<Result>(players * streets));
+    vector<string> errors(addrs.size());
+    vector<std::thread> threads;
+
+    for (size_t i = 0; i < addrs.size(); ++i)
+        threads.emplace_back(run_shard, std::cref(addrs[i]), std::cref(spot), i, addrs.size(),
+                             players, streets, shards[i].data(), std::ref(errors[i]));
+
+    for (std::thread& th : threads)
+        th.join();
+
+    bool ok = true;
+
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        if (errors[i].size()) {
+            cerr << "Shard " << i + 1 << " failed, " << errors[i] << endl;
+            ok = false;
+            continue;
+        }
+
+        uint64_t games = 0;
+        for (size_t p = 0; p < players; ++p)
+            games += KTie * shards[i][p].first + shards[i][p].second;
+
+        cout << "Shard " << i + 1 << "/" << addrs.size() << " on " << addrs[i]
+             << ": " << games / KTie << " games" << endl;
+
+        for (size_t k = 0; k < players * streets; ++k) {
+            results[k].first += shards[i][k].first;
+            results[k].second += shards[i][k].second;
+        }
+    }
+    return ok;
+#endif
+}
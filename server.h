@@ -0,0 +1,13 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include "poker.h"
+
+extern void server(const std::string& addr, size_t maxSpots);
+extern bool cluster(const std::vector<std::string>& addrs, const std::string& spot,
+                    size_t players, size_t streets, Result results[]);
+
+#endif // #ifndef SERVER_H_INCLUDED
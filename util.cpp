@@ -1,112 +1,54 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <sstream>
 #include <thread>
 #include <vector>
 
+#include "numa.h"
 #include "poker.h"
 #include "util.h"
 
 using namespace std;
 
-/// ScoreMask contains 1248 masks for each combination of 2 cards c1, c2 in range
-/// [0..63] with c1 > c2 and with c1, c2 of different face value (2,3..K,A).
-/// ScoreMask is indexed by (c1 << 6) + c2. ScoreMask bitwise AND the hand score
-/// to "fix" it for some special cases.
-uint64_t ScoreMask[4096];
-
 namespace {
 
-class Thread {
-
-    size_t idx;
-    PRNG prng;
-    Spot spot;
-    size_t gamesNum;
-    std::thread* th;
-    Result results[PLAYERS_NB];
-    std::vector<uint64_t> enumBuf;
-
-public:
-    Result result(size_t p) const { return results[p]; }
-
-    Thread(size_t id, const Spot& s, size_t n, size_t threadsNum, bool enumerate)
-        : idx(id)
-        , prng(id)
-        , spot(s)
-        , gamesNum(n)
-    {
-        memset(results, 0, sizeof(results));
-        spot.set_prng(&prng);
-
-        // Launch a thread that will call immediately Thread::run()
-        th = new std::thread(&Thread::run, this, enumerate, threadsNum);
-    }
-
-    void join()
-    {
-        th->join();
-        delete th;
-    }
-
-    void run(bool enumerate, size_t threadsNum)
-    {
-        if (enumerate) {
-            gamesNum = spot.set_enumerate(enumBuf, idx, threadsNum);
-            if (!gamesNum)
-                return;
-            prng.set_enum_buffer(enumBuf.data());
-        }
-        for (size_t i = 0; i < gamesNum; i++)
-            spot.run(results);
-    }
-};
-
-// Helpers used by init_score_mask()
+// Helpers used by make_score_mask()
 constexpr uint64_t set_counter(unsigned n)
 {
     return n << 13;
 }
-uint64_t clear_below(uint64_t b)
+constexpr uint64_t clear_below(uint64_t b)
 {
     return ~((b >> 16) | (b >> 32) | (b >> 48));
 }
-uint64_t clear_before(uint64_t b)
+constexpr unsigned msb_index(uint64_t b) // Portable msb(), for constexpr
 {
-    unsigned r = msb(b) / 16; // Rank in [0..3]
-    return ~((b - 1) & RanksBB[r]);
+    unsigned n = 0;
+    while (b >>= 1)
+        n++;
+    return n;
 }
-
-} // namespace
-
-/// Create, run and retire threads of execution, needed data is passed through
-/// the wrapping Thread object. New threads are created every time run is called.
-void run(const Spot& s, size_t gamesNum, size_t threadsNum,
-    bool enumerate, Result results[])
+constexpr uint64_t clear_before(uint64_t b)
 {
-    std::vector<Thread*> threads; // Pointers because std::vector reallocates
-
-    if (gamesNum < threadsNum)
-        threadsNum = 1;
-
-    size_t n = gamesNum / threadsNum;
-
-    for (size_t i = 0; i < threadsNum; ++i)
-        threads.push_back(new Thread(i, s, n, threadsNum, enumerate));
-
-    for (Thread* th : threads) {
-        th->join(); // Wait here for thread finished
-        for (size_t p = 0; p < s.players(); ++p) {
-            results[p].first += th->result(p).first;
-            results[p].second += th->result(p).second;
-        }
-        delete th;
-    }
+    unsigned r = msb_index(b) / 16; // Rank in [0..3]
+    return ~((b - 1) & RanksBB[r]);
 }
 
-/// Populate ScoreMask[] at startup. Table is indexed by the 2 highest bits of
+/// Compute ScoreMask[] at compile time. Table is indexed by the 2 highest bits of
 /// the score value that correspond to the hand's best combination (for instance
 /// a set and a pair). Given these 2 keys, the table is built such that a bitwise
 /// AND with the score produces the following:
@@ -118,8 +60,10 @@ void run(const Spot& s, size_t gamesNum, size_t threadsNum,
 /// - Set the number of bits that should remain in score's first rank, so that
 ///   the score uses just the best 5 cards out of 7.
 ///
-void init_score_mask()
+constexpr ScoreMaskTable make_score_mask()
 {
+    ScoreMaskTable t = {};
+
     // Fixed mask to clear the 3-bit counter and some flags that eventually
     // will be re-added when neded on specific cases (like double pair).
     constexpr uint64_t Init = ~(FullHouseBB | DoublePairBB | set_counter(7));
@@ -145,49 +89,696 @@ void init_score_mask()
             uint64_t l = 1ULL << c2;
 
             // Init and clear the columns below the 2 most significant bits
-            ScoreMask[idx] = Init & clear_below(h) & clear_below(l);
+            t.masks[idx] = Init & clear_below(h) & clear_below(l);
 
             // High card. Set counter to pick the 5 msb bits in score's first rank
             if (h & Rank1BB)
-                ScoreMask[idx] |= set_counter(5);
+                t.masks[idx] |= set_counter(5);
 
             // Single pair, we just need highest 3 bit of score's first rank
             else if ((h & Rank2BB) && (l & Rank1BB))
-                ScoreMask[idx] |= set_counter(3);
+                t.masks[idx] |= set_counter(3);
 
             // Double Pair. Use clear_before(l) to drop any possible third pair
             // that should not influence the score.
             else if ((h & Rank2BB) && (l & Rank2BB)) {
-                ScoreMask[idx] &= clear_before(l);
-                ScoreMask[idx] |= set_counter(1) | DoublePairBB;
+                t.masks[idx] &= clear_before(l);
+                t.masks[idx] |= set_counter(1) | DoublePairBB;
             }
             // Single Set. Nothing fancy.
             else if ((h & Rank3BB) && (l & Rank1BB))
-                ScoreMask[idx] |= set_counter(2);
+                t.masks[idx] |= set_counter(2);
 
             // Full house. Use clear_before(l) to drop any possible second pair
             // that should not influence the score.
             else if ((h & Rank3BB) && (l & Rank2BB)) {
-                ScoreMask[idx] &= clear_before(l);
-                ScoreMask[idx] |= set_counter(0) | FullHouseBB;
+                t.masks[idx] &= clear_before(l);
+                t.masks[idx] |= set_counter(0) | FullHouseBB;
             }
             // Double set. It's a full house, second set is counted as a pair,
             // so use clear_before(h), not clear_before(l) as in double pair.
             else if ((h & Rank3BB) && (l & Rank3BB)) {
-                ScoreMask[idx] &= clear_before(h);
+                t.masks[idx] &= clear_before(h);
                 // Re-add the (shifted) bit dropped by clear_below(h, l)
-                ScoreMask[idx] |= (l >> 16) | set_counter(0) | FullHouseBB;
+                t.masks[idx] |= (l >> 16) | set_counter(0) | FullHouseBB;
             }
             // Quad. Drop anything but first rank. Re-add the bit on first
             // rank in the column of l, that was dropped by clear_below(h, l)
             else if ((h & Rank4BB)) {
-                ScoreMask[idx] ^= ~clear_below(l); // Re-add bits below l
-                ScoreMask[idx] &= ~(Rank3BB | Rank2BB);
-                ScoreMask[idx] |= set_counter(1);
+                t.masks[idx] ^= ~clear_below(l); // Re-add bits below l
+                t.masks[idx] &= ~(Rank3BB | Rank2BB);
+                t.masks[idx] |= set_counter(1);
             } else
                 assert(false);
         }
     }
+    return t;
+}
+
+#ifndef USE_POPCNT
+
+constexpr PopCntTable make_popcnt16()
+{
+    PopCntTable t = {};
+
+    for (unsigned i = 1; i < (1 << 16); ++i)
+        t.counts[i] = uint8_t(t.counts[i >> 1] + (i & 1));
+
+    return t;
+}
+
+#endif
+
+} // namespace
+
+/// ScoreMask contains 1248 masks for each combination of 2 cards c1, c2 in range
+/// [0..63] with c1 > c2 and with c1, c2 of different face value (2,3..K,A).
+/// ScoreMask is indexed by (c1 << 6) + c2. ScoreMask bitwise AND the hand score
+/// to "fix" it for some special cases. It's computed by the compiler and lives
+/// in read only data, so there is no init at startup and the pages of the
+/// executable are shared among all its processes.
+constexpr ScoreMaskTable ScoreMask = make_score_mask();
+
+#ifndef USE_POPCNT
+constexpr PopCntTable PopCnt16 = make_popcnt16();
+#endif
+
+#ifdef USE_STATS
+thread_local PerfCounters Perf;
+#endif
+
+namespace {
+
+// Games a worker grabs at a time out of a Monte Carlo job. Small enough that
+// threads finish together also on short queries and on uneven cores.
+constexpr size_t ChunkGames = 16 * MAX_BATCH;
+
+// Games to play before checking the precision, so that we don't stop on the
+// few first games, where the estimated error can be far off.
+constexpr size_t MinGames = 8 * ChunkGames;
+
+typedef std::chrono::steady_clock Clock;
+
+/// A Job is a spot to run on up to threadsNum workers at once. A worker joins
+/// the job taking a free slot, that sets its share of the enumeration, or in
+/// Monte Carlo pulls chunks of games until none is left. After each chunk the
+/// worker publishes its counters, so that the job can stop early once the
+/// target precision is reached or the time is over.
+///
+/// Each chunk plays with its own PRNG stream, that depends only on the index
+/// of the chunk, so results are the same whatever the number of threads. When
+/// stopping at a precision, chunks are merged in order and the stop is checked
+/// after each of them, so that also the number of games doesn't depend on the
+/// threads. Only a time limit makes a run not reproducible.
+///
+/// A single spot job can be shard i of n of a run split among machines: it then
+/// plays only the chunks c with c % n == i, or with full enumeration the root
+/// cards of its workers among the n * threadsNum ones of the whole run. Shards
+/// play disjoint games that together are the ones of the whole run, so that
+/// with no precision or time limit the sum of their results is exactly the
+/// outcome of running the spot on a single machine.
+///
+/// A job can also be a batch of spots, each one of gamesNum games, that share
+/// the workers: chunks are handed out spot after spot, so a thread moves on to
+/// the next spot as soon as the current one has no more chunks, and with full
+/// enumeration each spot is enumerated whole by one worker. Results of spot i
+/// go to results + i * MAX_RESULTS. The PRNG streams of spot i are seeded also
+/// with i, so that the spots of a batch get independent games, and not the
+/// same ones as their chunks have the same indices.
+///
+/// Finally a job can be a task, that deals and scores its own games, as matrix
+/// mode does: each of the threadsNum workers calls it once with its slot.
+struct Job {
+
+    const Spot* spots;
+    Result* results;
+    HandStats* stats;
+    Result counts[MAX_RESULTS];
+    size_t spotsNum, gamesNum, chunksNum, threadsNum, slots, active, played;
+    size_t shard, shardsNum;
+    size_t nextMerge; // With a precision, chunks from here are still pending
+    std::map<size_t, std::pair<size_t, std::vector<Result>>> pending;
+    std::atomic<size_t> nextChunk;
+    std::atomic<bool> stop;
+    bool enumerate, done;
+    double precision;
+    Clock::time_point deadline;
+    std::function<size_t(size_t)> task;
+
+    Job(const Spot* s, size_t n, size_t games, size_t threads, bool e, Result r[],
+        double prec, int64_t msLimit, HandStats* hs = nullptr, size_t sh = 0, size_t shs = 1)
+        : spots(s), results(r), stats(hs), counts(), spotsNum(n), gamesNum(games)
+        , chunksNum(games / ChunkGames + (games % ChunkGames != 0))
+        , threadsNum(threads), slots(0), active(0), played(0), shard(sh), shardsNum(shs)
+        , nextMerge(0), nextChunk(0)
+        , stop(false), enumerate(e), done(false), precision(prec)
+        , deadline(msLimit ? Clock::now() + std::chrono::milliseconds(msLimit)
+                           : Clock::time_point::max()) {}
+
+    bool has_work() const {
+        return   slots < threadsNum
+              && (enumerate || task || (!stop && nextChunk < total_chunks()));
+    }
+
+    // Chunks to hand out, only the ones of our shard with a single spot
+    size_t total_chunks() const {
+        return spotsNum > 1 ? spotsNum * chunksNum
+             : chunksNum > shard ? (chunksNum - shard - 1) / shardsNum + 1 : 0;
+    }
+
+    // Return the games of the next chunk and set the index of its spot and
+    // of the chunk in the spot.
+    size_t next_chunk(size_t& spot, size_t& chunk) {
+        size_t c = stop ? total_chunks() : nextChunk.fetch_add(1);
+        if (c >= total_chunks())
+            return 0;
+
+        chunk = spotsNum > 1 ? c % chunksNum : c * shardsNum + shard;
+        spot = spotsNum > 1 ? c / chunksNum : 0;
+        return std::min(ChunkGames, gamesNum - chunk * ChunkGames);
+    }
+
+    void publish(size_t spot, size_t chunk, const Result r[], size_t games);
+    void merge(size_t spot, const Result r[], size_t games);
+    bool converged() const;
+};
+
+/// Add the counters of 'games' games of a worker, out of a chunk in Monte
+/// Carlo, to the results and check if we can stop. Called with the pool's
+/// mutex held.
+void Job::publish(size_t spot, size_t chunk, const Result r[], size_t games)
+{
+    if (enumerate || precision <= 0) {
+        merge(spot, r, games);
+        stop = !enumerate && Clock::now() >= deadline;
+        return;
+    }
+
+    // Chunks past the stop are dropped, the other ones wait for their turn,
+    // in the order they were handed out by our shard.
+    if (!stop)
+        pending[chunk / shardsNum] = { games, std::vector<Result>(r, r + MAX_RESULTS) };
+
+    for (auto it = pending.begin(); !stop && it != pending.end() && it->first == nextMerge; ) {
+        merge(spot, it->second.second.data(), it->second.first);
+        stop = converged() || Clock::now() >= deadline;
+        it = pending.erase(it);
+        nextMerge++;
+    }
+}
+
+/// Add the counters of 'games' games to the results of the spot
+void Job::merge(size_t spot, const Result r[], size_t games)
+{
+    const Spot& s = spots[spot];
+    Result* res = results + spot * MAX_RESULTS;
+
+    for (size_t p = 0; p < s.players() * s.streets(); ++p) {
+        res[p].first += r[p].first;
+        res[p].second += r[p].second;
+        counts[p].first += r[p].first;
+        counts[p].second += r[p].second;
+    }
+    played += games;
+}
+
+/// The standard error of the equity e of a player, that is in [0, 1], is bound
+/// by the one of a Bernoulli variable: sqrt(e * (1 - e) / games). In street
+/// mode all the streets should converge.
+bool Job::converged() const
+{
+    if (precision <= 0 || played < MinGames || spotsNum > 1)
+        return false;
+
+    size_t players = spots->players();
+
+    for (size_t s = 0; s < spots->streets(); ++s) {
+        const Result* c = counts + s * players;
+        double games = 0;
+
+        // Streets after the flop skip some games, count the ones they played
+        for (size_t p = 0; p < players; ++p)
+            games += (double(KTie) * c[p].first + c[p].second) / KTie;
+
+        games = s ? games : played;
+
+        for (size_t p = 0; p < players; ++p) {
+            double e = (double(KTie) * c[p].first + c[p].second) / KTie / games;
+            if (!(std::sqrt(e * (1 - e) / games) <= precision))
+                return false;
+        }
+    }
+    return true;
+}
+
+/// Games played by a pool's thread and the time it took, since last taken
+struct ThreadLoad {
+    uint64_t games, ns;
+};
+
+/// ThreadPool keeps its threads alive across calls to run(), sleeping while
+/// there is nothing to do, so that a query doesn't pay for thread creation.
+/// Many jobs can be in flight at once, the pool grows to the highest
+/// number of threads ever requested by them, up to maxThreads if set. Past
+/// that, the jobs share the workers: a worker that is done with a job takes
+/// a free slot of the next one, so that every slot is served in turn.
+///
+/// With pinning, each thread binds itself to a CPU of its NUMA node before
+/// its next job, and then drops its buffers, so that everything it writes is
+/// allocated afresh on its own node. The shared spots are only read, so they
+/// are served by the caches of each core and need no copies.
+class ThreadPool {
+
+    std::vector<std::thread> threads;
+    std::vector<PerfCounters> counters; // Of each thread, since last taken
+    std::vector<ThreadLoad> loads;
+    std::deque<Job*> jobs;
+    std::mutex mutex;
+    std::condition_variable sleepCond, doneCond;
+    size_t demand = 0; // Threads requested by the jobs in flight
+    size_t maxThreads = 0; // Cap of the threads, 0 for none
+    size_t pinGen = 0; // Incremented at each change of pinning
+    bool pinning = false;
+    bool exit = false;
+
+    void idle_loop(size_t id);
+    size_t work(Job* job, size_t slot, std::vector<uint64_t>& enumBuf);
+
+public:
+    ~ThreadPool();
+    void submit(Job& job);
+    void wait(Job& job);
+    void set_pinning(bool pin);
+    void set_max_threads(size_t n);
+    bool pinned();
+    std::vector<PerfCounters> take_counters();
+    std::vector<ThreadLoad> take_loads();
+};
+
+ThreadPool Pool;
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        exit = true;
+    }
+    sleepCond.notify_all();
+
+    for (std::thread& th : threads)
+        th.join();
+}
+
+/// Queue the job and wake up enough threads, without waiting for it
+void ThreadPool::submit(Job& job)
+{
+    std::unique_lock<std::mutex> lk(mutex);
+
+    if (!job.has_work()) {
+        job.done = true;
+        return;
+    }
+
+    demand += job.threadsNum;
+
+    while (threads.size() < std::min(demand, maxThreads ? maxThreads : SIZE_MAX)) {
+        threads.emplace_back(&ThreadPool::idle_loop, this, threads.size());
+        counters.emplace_back();
+        loads.emplace_back();
+    }
+
+    jobs.push_back(&job);
+
+    for (size_t i = 0; i < job.threadsNum; ++i)
+        sleepCond.notify_one();
+}
+
+/// Wait for a submitted job to be finished
+void ThreadPool::wait(Job& job)
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    doneCond.wait(lk, [&] { return job.done; });
+}
+
+/// Pin or unpin the threads, each one at its next job
+void ThreadPool::set_pinning(bool pin)
+{
+    numa_nodes(); // Read the topology while this thread has the process' CPUs
+
+    std::unique_lock<std::mutex> lk(mutex);
+    pinGen += pin != pinning;
+    pinning = pin;
+}
+
+/// Cap the threads of the pool, that already started ones are not stopped
+void ThreadPool::set_max_threads(size_t n)
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    maxThreads = n;
+}
+
+bool ThreadPool::pinned()
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    return pinning;
+}
+
+/// Return the load of each thread and clear it
+std::vector<ThreadLoad> ThreadPool::take_loads()
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    std::vector<ThreadLoad> l(loads.size());
+    loads.swap(l);
+    return l;
+}
+
+#ifdef USE_STATS
+
+/// Return the counters of each thread and clear them
+std::vector<PerfCounters> ThreadPool::take_counters()
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    std::vector<PerfCounters> c(counters.size());
+    counters.swap(c);
+    return c;
+}
+
+#endif
+
+/// Main loop of a pool's thread: sleep until there is a job with a free slot,
+/// take it and work, then go back to sleep. The last worker of a job with no
+/// more slots or games to hand out, signals the job is done.
+void ThreadPool::idle_loop(size_t id)
+{
+    std::vector<uint64_t> enumBuf; // Reused across jobs to save allocations
+    std::unique_lock<std::mutex> lk(mutex);
+    size_t gen = 0;
+
+    while (true) {
+        sleepCond.wait(lk, [&] { return exit || !jobs.empty(); });
+
+        if (exit)
+            return;
+
+        // Jobs with nothing left to hand out are finished by their workers
+        Job* job = jobs.front();
+        if (!job->has_work()) {
+            jobs.pop_front();
+            continue;
+        }
+        size_t slot = job->slots++;
+        job->active++;
+
+        bool repin = gen != pinGen, pin = pinning;
+        gen = pinGen;
+
+        lk.unlock();
+
+        if (repin) {
+            if (!pin || !numa_pin(id))
+                numa_unpin();
+            std::vector<uint64_t>().swap(enumBuf); // Touched again on the new node
+        }
+
+        Clock::time_point start = Clock::now();
+        size_t played = work(job, slot, enumBuf);
+        Clock::duration elapsed = Clock::now() - start;
+
+        lk.lock();
+
+        loads[id].games += played;
+        loads[id].ns += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+#ifdef USE_STATS
+        counters[id].add(Perf);
+        Perf = PerfCounters();
+#else
+        (void)id;
+#endif
+
+        if (--job->active == 0 && !job->has_work()) {
+            demand -= job->threadsNum;
+            job->done = true;
+            doneCond.notify_all();
+        }
+    }
+}
+
+/// Play the job's games and publish our counters to the job, after each chunk
+/// in Monte Carlo. Spots are shared by all the workers, only the small state of
+/// dealing is ours. Hand statistics, if any, are published at the end. Return
+/// the games played, or the combinations if enumerated.
+size_t ThreadPool::work(Job* job, size_t slot, std::vector<uint64_t>& enumBuf)
+{
+    Result results[MAX_RESULTS] = {};
+    std::unique_ptr<HandStats> stats(job->stats ? new HandStats() : nullptr);
+    Spot::State st = { nullptr, stats.get(), nullptr, INVALID };
+    size_t idx = 0, chunk = 0, total = 0;
+
+    if (job->task) {
+        total = job->task(slot);
+        std::unique_lock<std::mutex> lk(mutex);
+        job->played += total;
+    }
+    else if (job->enumerate && job->spotsNum == 1) {
+        size_t played = job->spots[0].run_enumerate(st, enumBuf,
+                                                    job->shard * job->threadsNum + slot,
+                                                    job->shardsNum * job->threadsNum, results);
+        total += played;
+        std::unique_lock<std::mutex> lk(mutex);
+        job->publish(0, 0, results, played);
+    }
+    else if (job->enumerate)
+        while ((idx = job->nextChunk.fetch_add(1)) < job->spotsNum) {
+            std::fill(results, results + MAX_RESULTS, Result());
+            size_t played = job->spots[idx].run_enumerate(st, enumBuf, 0, 1, results);
+            total += played;
+            std::unique_lock<std::mutex> lk(mutex);
+            job->publish(idx, 0, results, played);
+        }
+    else
+        while (size_t n = job->next_chunk(idx, chunk)) {
+            PRNG prng(chunk, job->spotsNum > 1 ? idx + 1 : 0);
+            st.prng = &prng;
+            std::fill(results, results + MAX_RESULTS, Result());
+            job->spots[idx].run_batch(st, n, results);
+            total += n;
+            std::unique_lock<std::mutex> lk(mutex);
+            job->publish(idx, chunk, results, n);
+        }
+
+    if (stats) {
+        std::unique_lock<std::mutex> lk(mutex);
+        job->stats->add(*stats);
+    }
+    return total;
+}
+
+} // namespace
+
+/// Run the spot on the thread pool and add the outcome to results. Monte Carlo
+/// games are split in chunks so that threads finish together and all gamesNum
+/// games are played, unless the standard error of all the equities falls below
+/// precision or msLimit milliseconds are elapsed. Full enumeration is split
+/// among threadsNum workers. With shardsNum > 1 only shard 'shard' of the run
+/// is played, see Job. Return the number of games played, or of combinations
+/// in case of full enumeration.
+size_t run(const Spot& s, size_t gamesNum, size_t threadsNum,
+    bool enumerate, Result results[], double precision, int64_t msLimit,
+    HandStats* stats, size_t shard, size_t shardsNum)
+{
+    Job job(&s, 1, gamesNum, std::max(threadsNum, size_t(1)), enumerate, results,
+            precision, msLimit, stats, shard, shardsNum);
+    Pool.submit(job);
+    Pool.wait(job);
+    return job.played;
+}
+
+/// Run n spots at once on the thread pool, each one with its own options, and
+/// wait for all of them. Outcomes are added to the results in args.
+void run(const Spot spots[], Args args[], size_t n)
+{
+    std::deque<Job> jobs; // Jobs are not movable, deque doesn't move them
+
+    for (size_t i = 0; i < n; ++i) {
+        Args& a = args[i];
+        jobs.emplace_back(&spots[i], 1, a.gamesNum, std::max(a.threadsNum, size_t(1)),
+                          a.enumerate, a.results, a.precision, a.msLimit, nullptr,
+                          a.shard, a.shardsNum);
+        Pool.submit(jobs.back());
+    }
+
+    for (Job& job : jobs)
+        Pool.wait(job);
+}
+
+/// Run a batch of spots of gamesNum games each, or fully enumerated, as a single
+/// job, so that threadsNum workers share all of them and none sits idle until
+/// the last chunk of the last spot. Useful for many small spots, as in ICM or
+/// range vs range sweeps, that would waste most of the time in thread hand-off
+/// if run one after the other. The outcome of spot i is added to the flat array
+/// results[i * MAX_RESULTS], in the same layout of run(). Return the total
+/// number of games played.
+size_t run_many(const std::vector<Spot>& spots, size_t gamesNum, size_t threadsNum,
+                bool enumerate, Result results[])
+{
+    if (spots.empty())
+        return 0;
+
+    Job job(spots.data(), spots.size(), gamesNum, std::max(threadsNum, size_t(1)),
+            enumerate, results, 0, 0);
+    Pool.submit(job);
+    Pool.wait(job);
+    return job.played;
+}
+
+/// Run task(slot) on threadsNum workers of the thread pool, one for each slot
+/// from 0 to threadsNum - 1, and wait for all of them. This is for modes that
+/// play their own games, so that they share the threads of the pool, with their
+/// pinning and their counters. Tasks return the games they played, that count
+/// in the load of their thread. Return the total of them.
+size_t run_tasks(size_t threadsNum, const std::function<size_t(size_t)>& task)
+{
+    Job job(nullptr, 0, 0, std::max(threadsNum, size_t(1)), false, nullptr, 0, 0);
+    job.task = task;
+    Pool.submit(job);
+    Pool.wait(job);
+    return job.played;
+}
+
+bool parse_number(const string& s, uint64_t max, uint64_t& v)
+{
+    char* end;
+    errno = 0;
+    v = s.size() && isdigit(s[0]) ? strtoull(s.c_str(), &end, 10) : 0;
+    return s.size() && isdigit(s[0]) && !*end && !errno && v <= max;
+}
+
+bool parse_number(const string& s, double& v)
+{
+    char* end;
+    v = s.size() ? strtod(s.c_str(), &end) : 0;
+    return s.size() && !*end && std::isfinite(v) && v >= 0;
+}
+
+/// Parse the options and the cards of a spot, as given to the go command, like
+/// "-t 4 -g 10M AcKd 7h7s - 8c 4d 7c". Return false if the value of an option
+/// is not a valid number, cards are checked later by Spot.
+bool parse_args(istream& is, Args& parsed)
+{
+    enum States { Option, Hole, Common };
+
+    map<string, string> args;
+    string token, value, sep = " ";
+    int holesCnt = 0;
+    States st = Option;
+
+    // Parse arguments
+    while (is >> token) {
+        if (st == Option) {
+            if (   token == "-p" || token == "-t" || token == "-g"
+                || token == "-c" || token == "-ms" || token == "-k") {
+                if (is >> value)
+                    args[token.substr(1)] = value;
+                continue;
+            } else if (token == "-e") {
+                args["e"] = "true";
+                continue;
+            } else if (token == "-s") {
+                args["s"] = "true";
+                continue;
+            } else if (token == "-h") {
+                args["h"] = "true";
+                continue;
+            } else if (token == "-d") {
+                args["d"] = "true";
+                continue;
+            } else if (token == "-l") {
+                args["l"] = "true";
+                continue;
+            } else if (token == "-") {
+                st = Common;
+                continue;
+            } else
+                st = Hole;
+        }
+        if (st == Hole) {
+            if (token == "-") {
+                st = Common;
+                continue;
+            }
+            if (token.front() == '[')
+                sep = "";
+            if (token.back() == ']')
+                sep = " ";
+            args["holes"] += token + sep;
+            holesCnt++;
+        }
+        if (st == Common)
+            args["commons"] += token;
+    }
+
+    // Process options
+    parsed.enumerate  = (args["e"] == "true");
+    parsed.streets    = (args["s"] == "true");
+    parsed.handStats  = (args["h"] == "true");
+    parsed.deck       = (args["d"] == "true");
+    parsed.lut        = (args["l"] == "true");
+    parsed.precision  = 0;
+    parsed.shard      = 0;
+    parsed.shardsNum  = 1;
+    parsed.sharded    = !args["k"].empty();
+
+    uint64_t threads = 1, players = holesCnt, ms = 0;
+    bool valid = true;
+
+    valid = valid && (args["t"].empty() || parse_number(args["t"], 1 << 16, threads));
+    valid = valid && (args["p"].empty() || parse_number(args["p"], PLAYERS_NB, players));
+    valid = valid && (args["ms"].empty() || parse_number(args["ms"], INT64_MAX, ms));
+
+    parsed.threadsNum = size_t(threads);
+    parsed.players    = int(players);
+    parsed.msLimit    = int64_t(ms);
+
+    // Shard as "i/n", 1 based, a shard out of range is caught by the callers
+    if (args["k"].size()) {
+        string k = args["k"];
+        size_t slash = k.find('/');
+        uint64_t i = 0, n = 0;
+
+        valid =    valid && slash != string::npos
+                && parse_number(k.substr(0, slash), SIZE_MAX, i)
+                && parse_number(k.substr(slash + 1), SIZE_MAX, n);
+
+        parsed.shardsNum = size_t(n);
+        parsed.shard = size_t(i) - 1;
+    }
+
+    if (args["c"].size()) {
+        string c = args["c"];
+        bool percent = (c.back() == '%');
+        if (percent)
+            c.pop_back();
+        valid = valid && parse_number(c, parsed.precision);
+        parsed.precision /= (percent ? 100 : 1);
+    }
+
+    if (args["g"].size()) {
+        string g = args["g"];
+        uint64_t mul = 1, n = 0;
+        if (tolower(g.back()) == 'm')
+            mul = 1000 * 1000, g.pop_back();
+        else if (tolower(g.back()) == 'k')
+            mul = 1000, g.pop_back();
+        valid = valid && parse_number(g, SIZE_MAX / mul, n);
+        parsed.gamesNum = size_t(n * mul);
+    } else if (parsed.precision > 0 || parsed.msLimit > 0)
+        parsed.gamesNum = SIZE_MAX; // Run until precision or time limit
+    else
+        parsed.gamesNum = 1000 * 1000;
+
+    parsed.pos = args["holes"] + "- " + args["commons"];
+    return valid;
 }
 
 const string pretty64(uint64_t b, bool headers)
@@ -245,11 +836,11 @@ ostream& operator<<(ostream& os, const Hand& h)
     return os;
 }
 
-void pretty_results(Result* results, size_t players)
+void pretty_results(const Result* results, size_t players)
 {
     size_t games = 0;
     for (size_t p = 0; p < players; p++)
-        games += KTie * results[p].first + results[p].second;
+        games += size_t(KTie) * results[p].first + results[p].second;
     games /= KTie;
 
     cout << std::showpoint << std::noshowpos << std::fixed << std::setprecision(2)
@@ -257,7 +848,7 @@ void pretty_results(Result* results, size_t players)
 
     for (size_t p = 0; p < players; p++) {
         cout << "P" << p + 1 << ": ";
-        size_t equity = KTie * results[p].first + results[p].second;
+        size_t equity = size_t(KTie) * results[p].first + results[p].second;
         cout << std::setw(6) << equity * 100.0 / KTie / games << "% "
              << std::setw(6) << results[p].first * 100.0 / games << "% "
              << std::setw(6) << results[p].second * 100.0 / KTie / games << "% "
@@ -265,3 +856,183 @@ void pretty_results(Result* results, size_t players)
              << std::setw(9) << double(results[p].second) / KTie << endl;
     }
 }
+
+void PerfCounters::add(const PerfCounters& c)
+{
+    draws += c.draws, dealt += c.dealt, rejected += c.rejected;
+    merges += c.merges, slowMerges += c.slowMerges;
+    scored += c.scored, flushes += c.flushes, straights += c.straights;
+    dealTime += c.dealTime, evalTime += c.evalTime, enumTime += c.enumTime;
+}
+
+void HandStats::add(const HandStats& s)
+{
+    for (int i = 0; i < PLAYERS_NB; ++i) {
+        for (unsigned c = 0; c < CATEGORIES_NB; ++c)
+            categories[i][c] += s.categories[i][c];
+        for (int c = 0; c < 64; ++c)
+            outs[i][c] += s.outs[i][c];
+    }
+    for (int c = 0; c < 64; ++c) {
+        riverGames[c] += s.riverGames[c];
+        flips[c] += s.flips[c];
+    }
+}
+
+// Print the river cards with the share of their games in count[], with the
+// share only when it is not all of them. Return the sum of the shares.
+double pretty_cards(ostream& os, const uint64_t count[], const uint64_t games[])
+{
+    double sum = 0;
+
+    for (unsigned c = 0; c < 64; ++c)
+        if (count[c]) {
+            double share = double(count[c]) / games[c];
+            sum += share;
+            os << Card(c);
+            if (count[c] < games[c])
+                os << "(" << std::fixed << std::setprecision(0) << share * 100 << "%) ";
+        }
+    return sum;
+}
+
+/// Print the histogram of the final hand categories of each player and, in
+/// turn spots, the river cards that give the pot to a player behind on the
+/// turn, for all the players and for each one. The outs of a player are the
+/// sum of the shares of the games where each card does it.
+void pretty_stats(const HandStats& s, size_t players)
+{
+    const char* Names[] = { "High", "Pair", "2Pair", "Set", "Strgt", "Flush",
+                            "Full", "Quads", "StrFl" };
+
+    cout << "\n   ";
+    for (const char* n : Names)
+        cout << std::setw(8) << n;
+    cout << endl;
+
+    for (size_t p = 0; p < players; p++) {
+        uint64_t games = 0;
+        for (unsigned c = 0; c < CATEGORIES_NB; ++c)
+            games += s.categories[p][c];
+
+        cout << "P" << p + 1 << ":" << std::fixed << std::setprecision(2);
+        for (unsigned c = 0; c < CATEGORIES_NB; ++c)
+            cout << std::setw(7) << s.categories[p][c] * 100.0 / std::max(games, uint64_t(1)) << "%";
+        cout << endl;
+    }
+
+    if (!std::accumulate(s.riverGames, s.riverGames + 64, uint64_t(0)))
+        return;
+
+    cout << "\nRiver cards changing the winner: ";
+    pretty_cards(cout, s.flips, s.riverGames);
+    cout << endl;
+
+    for (size_t p = 0; p < players; p++) {
+        stringstream ss;
+        double outs = pretty_cards(ss, s.outs[p], s.riverGames);
+        cout << "P" << p + 1 << " outs: " << std::setprecision(2) << outs
+             << " " << ss.str() << endl;
+    }
+}
+
+/// Print the hot path counters of each pool's thread that worked since the
+/// last call, and their sum, then clear them. Rates are on the draws, merges
+/// and hands they refer to, times in milliseconds.
+void pretty_counters()
+{
+#ifndef USE_STATS
+    cout << "Counters are compiled out, build with stats=yes" << endl;
+#else
+    std::vector<PerfCounters> threads = Pool.take_counters();
+    PerfCounters total = PerfCounters();
+
+    auto percent = [](uint64_t n, uint64_t of) { return n * 100.0 / std::max(of, uint64_t(1)); };
+
+    auto print = [&](const string& name, const PerfCounters& c) {
+        cout << std::left << std::setw(7) << name << std::right
+             << std::fixed << std::setprecision(2)
+             << std::setw(12) << c.draws
+             << std::setw(8) << percent(c.rejected, c.dealt + c.rejected) << "%"
+             << std::setw(8) << percent(c.slowMerges, c.merges) << "%"
+             << std::setw(12) << c.scored
+             << std::setw(8) << percent(c.flushes, c.scored) << "%"
+             << std::setw(8) << percent(c.straights, c.scored) << "%"
+             << std::setprecision(1)
+             << std::setw(10) << c.dealTime / 1e6
+             << std::setw(10) << c.evalTime / 1e6
+             << std::setw(10) << c.enumTime / 1e6 << endl;
+    };
+
+    cout << "\n" << std::left << std::setw(7) << "Thread" << std::right
+         << std::setw(12) << "Draws" << std::setw(9) << "Reject"
+         << std::setw(9) << "SlowMrg" << std::setw(12) << "Scored"
+         << std::setw(9) << "Flush" << std::setw(9) << "Strght"
+         << std::setw(10) << "ms deal" << std::setw(10) << "ms eval"
+         << std::setw(10) << "ms enum" << endl;
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        if (threads[i].dealt || threads[i].scored) {
+            print("T" + std::to_string(i + 1), threads[i]);
+            total.add(threads[i]);
+        }
+
+    print("Total", total);
+#endif
+}
+
+/// Pin, or unpin, the pool's threads to the CPUs of their NUMA nodes
+void set_pinning(bool pin)
+{
+    Pool.set_pinning(pin);
+}
+
+/// Cap the pool's threads, shared by all the jobs in flight, 0 for no cap
+void set_max_threads(size_t n)
+{
+    Pool.set_max_threads(n);
+}
+
+/// Print the NUMA nodes, with the games played by their threads since the last
+/// call and the throughput, then clear them. Throughput is the sum of the one
+/// of each thread while working, so nodes with the same threads should match.
+void pretty_numa()
+{
+    const std::vector<std::vector<int>>& nodes = numa_nodes();
+    std::vector<ThreadLoad> loads = Pool.take_loads();
+
+    cout << "Threads " << (Pool.pinned() ? "pinned" : "not pinned")
+         << ", NUMA nodes: " << nodes.size() << "\n"
+         << std::left << std::setw(7) << "Node" << std::right
+         << std::setw(6) << "CPUs" << std::setw(9) << "Threads"
+         << std::setw(14) << "Games" << std::setw(14) << "Games/second" << endl;
+
+    double totalRate = 0;
+    uint64_t totalGames = 0;
+    size_t totalThreads = 0, totalCpus = 0;
+
+    auto print = [](const string& name, size_t cpus, size_t threads, uint64_t games, double rate) {
+        cout << std::left << std::setw(7) << name << std::right
+             << std::setw(6) << cpus << std::setw(9) << threads
+             << std::setw(14) << games << std::setw(14) << uint64_t(rate) << endl;
+    };
+
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        double rate = 0;
+        uint64_t games = 0;
+        size_t threads = 0;
+
+        for (size_t id = n; id < loads.size(); id += nodes.size())
+            if (loads[id].ns) {
+                rate += loads[id].games * 1e9 / loads[id].ns;
+                games += loads[id].games;
+                threads++;
+            }
+
+        print("N" + std::to_string(n), nodes[n].size(), threads, games, rate);
+        totalRate += rate, totalGames += games, totalThreads += threads;
+        totalCpus += nodes[n].size();
+    }
+
+    print("Total", totalCpus, totalThreads, totalGames, totalRate);
+}
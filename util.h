@@ -6,32 +6,115 @@
 #include <cstdint>
 #include <string>
 
-typedef std::pair<unsigned, unsigned> Result;
+/// Games won and shares of split pots of a player, with 64 bits counters that
+/// don't wrap around even in the longest runs and enumerations.
+typedef std::pair<uint64_t, uint64_t> Result;
+
+/// The least multiple of 2, 3, ... 9 used to score split results, so that a
+/// pot split among any number of players is counted exactly.
+constexpr unsigned KTie = 2520;
+
+/// Counters of the hot paths, kept by each thread in builds with USE_STATS
+/// (make stats=yes), to see where a run spends its time without a profiler.
+/// Otherwise STATS() statements compile to nothing, so that the counters cost
+/// nothing in the normal builds. Pool's threads add their ones to the pool's
+/// after each job, times are in nanoseconds.
+struct PerfCounters {
+    uint64_t draws;      // Randoms out of the PRNG
+    uint64_t dealt;      // Cards and range combos taken out of randoms
+    uint64_t rejected;   // Cards and combos drawn but already dealt or invalid
+    uint64_t merges;     // Hole cards merged with the board by Hand::merge()
+    uint64_t slowMerges; // Merges that had to add cards one by one
+    uint64_t scored;     // Hands scored by score_hands()
+    uint64_t flushes;    // Scored hands where the flush step applies
+    uint64_t straights;  // Scored hands where the straight step applies
+    uint64_t dealTime;   // Dealing games, also out of the enumerated ones
+    uint64_t evalTime;   // Scoring games and adding up the results
+    uint64_t enumTime;   // Generating the games of full enumeration
+
+    void add(const PerfCounters& c);
+};
+
+#ifdef USE_STATS
+
+#include <chrono>
+
+extern thread_local PerfCounters Perf;
+
+inline uint64_t now_ns()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+#define STATS(x) (x)
 
-/// A constant divisible by 2,3,4,5,6 used to score split results
-constexpr unsigned KTie = 60;
+#else
 
-/// Our PRNG class is a wrapper around Xoroshiro128+. Used for Monte Carlo
+#define STATS(x) ((void)0)
+
+#endif
+
+/// Our PRNG class is a wrapper around Xoroshiro128+. Used for Monte Carlo, it
+/// is the only source of numbers in the hot loop, so next() is inline and
+/// branch free. fill() writes a block of numbers at once, the same ones that
+/// as many calls to next() would return. Streams are numbered: the stream idx
+/// is always the same, and it's seeded in constant time.
 class PRNG {
 
     uint64_t s[2];
-    uint64_t* buf;
 
-    void jump(void);
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    explicit PRNG(uint64_t idx, uint64_t seed = 0);
+    void fill(uint64_t out[], size_t n);
+
+    uint64_t next() {
+        STATS(Perf.draws++);
+
+        const uint64_t s0 = s[0];
+        uint64_t s1 = s[1];
+        const uint64_t result = s0 + s1;
+
+        s1 ^= s0;
+        s[0] = rotl(s0, 55) ^ s1 ^ (s1 << 14); // a, b
+        s[1] = rotl(s1, 36); // c
+
+        return result;
+    }
+};
+
+/// Source of numbers of full enumeration: it replays the ones packed by
+/// Spot::enumerate() in the buffer, in place of the PRNG.
+class EnumSource {
+
+    const uint64_t* buf;
 
 public:
-    PRNG(size_t idx, uint64_t seed = 0);
-    uint64_t next();
-    void set_enum_buffer(uint64_t* b) { buf = b; }
+    explicit EnumSource(const uint64_t* b) : buf(b) {}
+    uint64_t next() { return *buf++; }
 };
 
+#ifndef USE_POPCNT
+
+/// Number of bits set of each 16 bit value, computed at compile time
+struct PopCntTable {
+    uint8_t counts[1 << 16];
+
+    constexpr uint8_t operator[](size_t idx) const { return counts[idx]; }
+};
+
+extern const PopCntTable PopCnt16;
+
+#endif
+
 /// popcount() counts the number of non-zero bits in a uint64_t
 inline int popcount(uint64_t b)
 {
 
 #ifndef USE_POPCNT
 
-    extern uint8_t PopCnt16[1 << 16];
     union {
         uint64_t bb;
         uint16_t u[4];
@@ -146,6 +229,12 @@ inline uint64_t msb_bb(uint64_t b)
 
 /// Pretty printers of a uint64_t in "table of bits" format and of equity results
 extern const std::string pretty64(uint64_t b, bool headers = false);
-extern void pretty_results(Result* results, size_t players);
+extern void pretty_results(const Result* results, size_t players);
+
+/// Parsers of a whole string as a number, up to max for the integers and not
+/// negative for the reals. Unlike stoi() and friends, that terminate on bad
+/// input in a build without exceptions, they return false.
+extern bool parse_number(const std::string& s, uint64_t max, uint64_t& v);
+extern bool parse_number(const std::string& s, double& v);
 
 #endif // #ifndef UTIL_H_INCLUDED
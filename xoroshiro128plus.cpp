@@ -35,54 +35,39 @@ See <http://creativecommons.org/publicdomain/zero/1.0/>. */
    a 64-bit seed, we suggest to seed a splitmix64 generator and use its
    output to fill s. */
 
-static inline uint64_t rotl(const uint64_t x, int k) {
-    return (x << k) | (x >> (64 - k));
-}
+/* PRNG::next() is inline, in util.h, so that the dealing loops can keep the
+   state in registers. */
 
-uint64_t PRNG::next() {
+void PRNG::fill(uint64_t out[], size_t n) {
 
-    if (buf)
-        return *buf++;
+    STATS(Perf.draws += n);
 
-    const uint64_t s0 = s[0];
+    uint64_t s0 = s[0];
     uint64_t s1 = s[1];
-    const uint64_t result = s0 + s1;
-
-    s1 ^= s0;
-    s[0] = rotl(s0, 55) ^ s1 ^ (s1 << 14); // a, b
-    s[1] = rotl(s1, 36); // c
 
-    return result;
-}
+    for (size_t i = 0; i < n; i++) {
+        out[i] = s0 + s1;
+        s1 ^= s0;
+        s0 = rotl(s0, 55) ^ s1 ^ (s1 << 14); // a, b
+        s1 = rotl(s1, 36); // c
+    }
 
-PRNG::PRNG(size_t idx, uint64_t seed) {
-    buf = nullptr;
-    s[0] = seed ? seed : 0x4209920184674cbfULL;
-    s[1] = 0;
-    next();
-    next();
-    while (idx--)
-        jump();
+    s[0] = s0;
+    s[1] = s1;
 }
 
-/* This is the jump function for the generator. It is equivalent
-   to 2^64 calls to next(); it can be used to generate 2^64
-   non-overlapping subsequences for parallel computations. */
-
-void PRNG::jump() {
-    static const uint64_t JUMP[] = { 0xbeac0467eba5facb, 0xd86b048b86aa9922 };
+/* Seeding uses a splitmix64 generator, as suggested above: stream idx takes
+   its state out of the 2 * idx + 1 and 2 * idx + 2 outputs of it, so that
+   each stream is seeded in constant time and no two share their state. This
+   replaces the jump function, that would cost idx jumps for stream idx. */
 
-    uint64_t s0 = 0;
-    uint64_t s1 = 0;
-    for(size_t i = 0; i < sizeof(JUMP) / sizeof(*JUMP); i++)
-        for(int b = 0; b < 64; b++) {
-            if (JUMP[i] & 1ULL << b) {
-                s0 ^= s[0];
-                s1 ^= s[1];
-            }
-            next();
-        }
+PRNG::PRNG(uint64_t idx, uint64_t seed) {
+    uint64_t x = (seed ? seed : 0x4209920184674cbfULL) + 2 * idx * 0x9e3779b97f4a7c15ULL;
 
-    s[0] = s0;
-    s[1] = s1;
+    for (int i = 0; i < 2; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s[i] = z ^ (z >> 31);
+    }
 }